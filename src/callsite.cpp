@@ -0,0 +1,21 @@
+#include <string>
+
+#include "callsite.h"
+#include "json_writer.h"
+
+Callsite::Callsite(const char *file, int line, const char *function, LogLevel level)
+    : file_(file),
+      line_(line),
+      function_(function),
+      level_(level)
+{
+  auto add = [&](const char *key, AttributeValue value)
+  {
+    std::string encoded;
+    appendJsonMember(encoded, key, value);
+    attributes_.entries.push_back(BoundAttributes::Entry{key, hashKey(key, std::char_traits<char>::length(key)), std::move(value), std::move(encoded)});
+  };
+  add("code.filepath", file);
+  add("code.lineno", line);
+  add("code.function", function);
+}
@@ -0,0 +1,43 @@
+#ifndef CALLSITE_H
+#define CALLSITE_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "log_message.h"
+
+// Static description of one logging statement. The VIGILANT_* macros create
+// one per call site, on first use, and every record logged there carries a
+// pointer to it rather than copies of its fields. The source location is
+// encoded as JSON once, here, and the encoder copies the bytes into each
+// record as the code.filepath, code.lineno and code.function attributes.
+class Callsite
+{
+public:
+  Callsite(const char *file, int line, const char *function, LogLevel level);
+
+  Callsite(const Callsite &) = delete;
+  Callsite &operator=(const Callsite &) = delete;
+
+  const char *file() const { return file_; }
+  int line() const { return line_; }
+  const char *function() const { return function_; }
+  LogLevel level() const { return level_; }
+
+  // The source location as pre-encoded attributes.
+  const BoundAttributes &attributes() const { return attributes_; }
+
+  // Rate-limit state used by the Sampler: the earliest time, in
+  // steady_clock nanoseconds, at which the call site has a token to spare
+  // (the "theoretical arrival time" of GCRA).
+  std::atomic<int64_t> nextFree{0};
+
+private:
+  const char *file_;
+  int line_;
+  const char *function_;
+  LogLevel level_;
+  BoundAttributes attributes_;
+};
+
+#endif // CALLSITE_H
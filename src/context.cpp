@@ -0,0 +1,70 @@
+#include <string>
+#include <vector>
+#include <utility>
+#include <iostream>
+
+#include "context.h"
+
+ScopedContext::ScopedContext(std::initializer_list<Attribute> attrs)
+    : count_(0)
+{
+  for (auto &attr : attrs)
+  {
+    if (count_ == kMaxAttributes)
+    {
+      warnTooMany(attrs.size());
+      break;
+    }
+    add(KeyValue(attr));
+  }
+  push();
+}
+
+ScopedContext::ScopedContext(std::vector<Attribute> attrs)
+    : count_(0)
+{
+  for (auto &attr : attrs)
+  {
+    if (count_ == kMaxAttributes)
+    {
+      warnTooMany(attrs.size());
+      break;
+    }
+    add(KeyValue(std::move(attr)));
+  }
+  push();
+}
+
+ScopedContext::~ScopedContext()
+{
+  current().depth--;
+  for (size_t i = 0; i < count_; ++i)
+  {
+    items_[i].~KeyValue();
+  }
+}
+
+ScopedContext::Stack &ScopedContext::current()
+{
+  // Zero-initialized, so no constructor runs when a thread first touches it.
+  static thread_local Stack stack;
+  return stack;
+}
+
+void ScopedContext::push()
+{
+  // Frames past the capacity are only counted, so that the matching
+  // destructors leave the stack balanced.
+  Stack &stack = current();
+  if (stack.depth < kMaxDepth)
+  {
+    stack.frames[stack.depth] = this;
+  }
+  stack.depth++;
+}
+
+void ScopedContext::warnTooMany(size_t count)
+{
+  std::cerr << "ScopedContext holds at most " << kMaxAttributes << " attributes; ignoring "
+            << count - kMaxAttributes << std::endl;
+}
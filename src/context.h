@@ -0,0 +1,88 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <string>
+#include <vector>
+#include <initializer_list>
+#include <utility>
+#include <new>
+
+#include "log_message.h"
+
+// Adds attributes to every record logged on the current thread while it is
+// in scope, by any Logger:
+//
+//   ScopedContext ctx(kv("trace_id", id));
+//   ScopedContext ctx{{"tenant", tenant}};
+//
+// Scopes nest; inner ones take precedence over outer ones, and attributes
+// passed to an individual call take precedence over both. A scope keeps up
+// to kMaxAttributes attributes inline and each thread keeps a fixed-size
+// stack of pointers to the live scopes, so entering a scope does not
+// allocate beyond copying string keys and values too long for the small
+// string buffer; kv() keys are never copied. Scopes nested deeper than
+// kMaxDepth are ignored.
+class ScopedContext
+{
+public:
+  static constexpr size_t kMaxDepth = 32;
+  static constexpr size_t kMaxAttributes = 8;
+
+  template <typename... Fields, typename = EnableIfFields<Fields...>>
+  explicit ScopedContext(Fields &&...fields) : count_(0)
+  {
+    static_assert(sizeof...(Fields) <= kMaxAttributes, "ScopedContext holds at most kMaxAttributes attributes");
+    (add(KeyValue(std::forward<Fields>(fields))), ...);
+    push();
+  }
+
+  // Attributes past kMaxAttributes are dropped with a warning.
+  ScopedContext(std::initializer_list<Attribute> attrs);
+  explicit ScopedContext(std::vector<Attribute> attrs);
+  ~ScopedContext();
+
+  ScopedContext(const ScopedContext &) = delete;
+  ScopedContext &operator=(const ScopedContext &) = delete;
+
+  // Calls fn(attribute) for each attribute in scope on this thread, from the
+  // outermost scope to the innermost.
+  template <typename Fn>
+  static void forEach(Fn &&fn)
+  {
+    const Stack &stack = current();
+    size_t depth = stack.depth < kMaxDepth ? stack.depth : kMaxDepth;
+    for (size_t i = 0; i < depth; ++i)
+    {
+      const ScopedContext &scope = *stack.frames[i];
+      for (size_t j = 0; j < scope.count_; ++j)
+      {
+        fn(scope.items_[j]);
+      }
+    }
+  }
+
+private:
+  struct Stack
+  {
+    const ScopedContext *frames[kMaxDepth];
+    size_t depth;
+  };
+
+  // Constructed in place up to count_, so that KeyValue needs no default
+  // constructor.
+  union
+  {
+    KeyValue items_[kMaxAttributes];
+  };
+  size_t count_;
+
+  void add(KeyValue &&item)
+  {
+    new (&items_[count_++]) KeyValue(std::move(item));
+  }
+  static Stack &current();
+  void push();
+  static void warnTooMany(size_t count);
+};
+
+#endif // CONTEXT_H
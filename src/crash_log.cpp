@@ -0,0 +1,237 @@
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "crash_log.h"
+
+namespace
+{
+  constexpr size_t kMaxCrashLogs = 16;
+  std::atomic<CrashLog *> crashLogs[kMaxCrashLogs];
+
+  const int kFatalSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+  constexpr size_t kFatalSignalCount = sizeof(kFatalSignals) / sizeof(kFatalSignals[0]);
+  struct sigaction previousActions[kFatalSignalCount];
+  std::once_flag handlersOnce;
+  std::atomic<bool> dumping(false);
+}
+
+CrashLog::CrashLog(const std::string &path, size_t capacity)
+    : path_(path),
+      fd_(::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)),
+      capacity_(capacity > 0 ? capacity : 1),
+      slots_(new Slot[capacity_]),
+      settled_(0)
+{
+  if (fd_ < 0)
+  {
+    std::cerr << "Failed to open crash log " << path_ << ": " << std::strerror(errno) << std::endl;
+    return;
+  }
+
+  for (size_t i = 0; i < capacity_; ++i)
+  {
+    slots_[i].seq.store(0, std::memory_order_relaxed);
+    slots_[i].size = 0;
+  }
+
+  std::call_once(handlersOnce, &CrashLog::installHandlers);
+  for (auto &entry : crashLogs)
+  {
+    CrashLog *expected = nullptr;
+    if (entry.compare_exchange_strong(expected, this))
+    {
+      break;
+    }
+  }
+}
+
+CrashLog::~CrashLog()
+{
+  for (auto &entry : crashLogs)
+  {
+    CrashLog *expected = this;
+    entry.compare_exchange_strong(expected, nullptr);
+  }
+  if (fd_ >= 0)
+  {
+    ::close(fd_);
+  }
+}
+
+std::vector<std::string> CrashLog::takeReplay()
+{
+  std::vector<std::string> lines;
+  if (fd_ < 0)
+  {
+    return lines;
+  }
+
+  std::string contents;
+  char buffer[4096];
+  ::lseek(fd_, 0, SEEK_SET);
+  while (true)
+  {
+    ssize_t n = ::read(fd_, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    contents.append(buffer, static_cast<size_t>(n));
+  }
+  if (::ftruncate(fd_, 0) != 0)
+  {
+    std::cerr << "Failed to truncate crash log " << path_ << std::endl;
+  }
+
+  size_t start = 0;
+  while (start < contents.size())
+  {
+    size_t end = contents.find('\n', start);
+    if (end == std::string::npos)
+    {
+      end = contents.size();
+    }
+    if (end > start)
+    {
+      lines.emplace_back(contents, start, end - start);
+    }
+    start = end + 1;
+  }
+  return lines;
+}
+
+void CrashLog::record(uint64_t seq, const std::string &line)
+{
+  if (fd_ < 0)
+  {
+    return;
+  }
+
+  // The slot is marked empty while it is rewritten so that a handler running
+  // on this thread never writes a half-copied record.
+  Slot &slot = slots_[seq % capacity_];
+  slot.seq.store(0, std::memory_order_relaxed);
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+
+  // Exporter::encodeCrashLine keeps lines within a slot; anything longer
+  // would be cut mid-record and fail to replay.
+  size_t size = std::min(line.size(), kSlotSize - 1);
+  std::memcpy(slot.data, line.data(), size);
+  slot.data[size] = '\n';
+  slot.size = static_cast<uint32_t>(size + 1);
+
+  slot.seq.store(seq, std::memory_order_release);
+}
+
+void CrashLog::markSettled(uint64_t seq)
+{
+  settled_.store(seq, std::memory_order_release);
+}
+
+void CrashLog::reset()
+{
+  for (size_t i = 0; i < capacity_; ++i)
+  {
+    slots_[i].seq.store(0, std::memory_order_relaxed);
+  }
+  settled_.store(0, std::memory_order_relaxed);
+}
+
+void CrashLog::dump()
+{
+  // Async-signal-safe: atomic loads and write(2) only.
+  if (fd_ < 0)
+  {
+    return;
+  }
+  uint64_t settled = settled_.load(std::memory_order_acquire);
+
+  // Slot i holds a sequence number congruent to i, so walking the ring from
+  // the oldest unsettled record writes them in sequence order.
+  uint64_t oldest = UINT64_MAX;
+  for (size_t i = 0; i < capacity_; ++i)
+  {
+    uint64_t seq = slots_[i].seq.load(std::memory_order_acquire);
+    if (seq != 0 && seq > settled && seq < oldest)
+    {
+      oldest = seq;
+    }
+  }
+  if (oldest == UINT64_MAX)
+  {
+    return;
+  }
+
+  for (size_t i = 0; i < capacity_; ++i)
+  {
+    const Slot &slot = slots_[(oldest + i) % capacity_];
+    uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq == 0 || seq <= settled)
+    {
+      continue;
+    }
+    const char *data = slot.data;
+    size_t remaining = slot.size;
+    while (remaining > 0)
+    {
+      ssize_t n = ::write(fd_, data, remaining);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      data += n;
+      remaining -= static_cast<size_t>(n);
+    }
+  }
+}
+
+void CrashLog::installHandlers()
+{
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = &CrashLog::onFatalSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_ONSTACK;
+
+  for (size_t i = 0; i < kFatalSignalCount; ++i)
+  {
+    ::sigaction(kFatalSignals[i], &action, &previousActions[i]);
+  }
+}
+
+void CrashLog::onFatalSignal(int sig)
+{
+  int savedErrno = errno;
+  if (!dumping.exchange(true))
+  {
+    for (auto &entry : crashLogs)
+    {
+      CrashLog *crashLog = entry.load(std::memory_order_acquire);
+      if (crashLog != nullptr)
+      {
+        crashLog->dump();
+      }
+    }
+  }
+
+  // Hand the signal to whoever was installed before us, or to the default
+  // action, and raise it again so the process dies as it would have.
+  for (size_t i = 0; i < kFatalSignalCount; ++i)
+  {
+    if (kFatalSignals[i] == sig)
+    {
+      ::sigaction(sig, &previousActions[i], nullptr);
+      break;
+    }
+  }
+  errno = savedErrno;
+  ::raise(sig);
+}
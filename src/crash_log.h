@@ -0,0 +1,61 @@
+#ifndef CRASH_LOG_H
+#define CRASH_LOG_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+// Keeps a copy of the most recent records, already serialized as JSON lines,
+// in fixed-size slots so that a fatal-signal handler can write the ones that
+// have not been delivered yet to a pre-opened file using only write(2).
+// On the next start takeReplay() returns what the crashed process left
+// behind so it can be uploaded.
+class CrashLog
+{
+public:
+  static constexpr size_t kSlotSize = 1024;
+
+  CrashLog(const std::string &path, size_t capacity);
+  ~CrashLog();
+
+  CrashLog(const CrashLog &) = delete;
+  CrashLog &operator=(const CrashLog &) = delete;
+
+  bool isOpen() const { return fd_ >= 0; }
+
+  // Reads and truncates the lines written by a previous crash.
+  std::vector<std::string> takeReplay();
+
+  // Stores the serialized record with sequence number seq. Callers must
+  // serialize record() calls; the signal handler may run at any point.
+  void record(uint64_t seq, const std::string &line);
+
+  // Records with a sequence number up to and including seq no longer need
+  // to be written on a crash.
+  void markSettled(uint64_t seq);
+
+  // Forgets every record, e.g. in the child after fork().
+  void reset();
+
+private:
+  struct Slot
+  {
+    std::atomic<uint64_t> seq;
+    uint32_t size;
+    char data[kSlotSize];
+  };
+
+  std::string path_;
+  int fd_;
+  size_t capacity_;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<uint64_t> settled_;
+
+  void dump();
+  static void installHandlers();
+  static void onFatalSignal(int sig);
+};
+
+#endif // CRASH_LOG_H
@@ -0,0 +1,189 @@
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "dedup.h"
+
+namespace
+{
+  uint64_t mix(uint64_t hash, const void *data, size_t size)
+  {
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+      hash ^= bytes[i];
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  }
+
+  uint64_t mixValue(uint64_t hash, const AttributeValue &value)
+  {
+    auto type = static_cast<unsigned char>(value.type());
+    hash = mix(hash, &type, 1);
+    switch (value.type())
+    {
+    case AttributeValue::Type::String:
+      return mix(hash, value.asString().data(), value.asString().size());
+    case AttributeValue::Type::Int:
+    case AttributeValue::Type::Timestamp:
+    {
+      int64_t v = value.asInt();
+      return mix(hash, &v, sizeof(v));
+    }
+    case AttributeValue::Type::Uint:
+    {
+      uint64_t v = value.asUint();
+      return mix(hash, &v, sizeof(v));
+    }
+    case AttributeValue::Type::Double:
+    {
+      double v = value.asDouble();
+      return mix(hash, &v, sizeof(v));
+    }
+    case AttributeValue::Type::Bool:
+    {
+      unsigned char v = value.asBool() ? 1 : 0;
+      return mix(hash, &v, 1);
+    }
+    case AttributeValue::Type::Null:
+      return hash;
+    }
+    return hash;
+  }
+}
+
+Deduplicator::Deduplicator(std::chrono::milliseconds window, size_t capacity)
+    : window_(window),
+      entries_(std::max(capacity, kProbe)),
+      nextExpiry_(std::chrono::steady_clock::time_point::max())
+{
+}
+
+bool Deduplicator::absorb(LogMessage &message, std::chrono::steady_clock::time_point now, std::vector<LogMessage> &out)
+{
+  uint64_t hash = hashRecord(message);
+  size_t start = static_cast<size_t>(hash % entries_.size());
+
+  // When every probed slot is taken, evict an entry that has not repeated,
+  // if any, since it has nothing to summarize; otherwise the oldest.
+  Entry *free = nullptr;
+  Entry *victim = nullptr;
+  for (size_t i = 0; i < kProbe; ++i)
+  {
+    Entry &entry = entries_[(start + i) % entries_.size()];
+    if (!entry.used)
+    {
+      if (free == nullptr)
+        free = &entry;
+      continue;
+    }
+    if (entry.hash == hash && now < entry.windowEnd)
+    {
+      // The first repeat is kept as the template for the summary, so
+      // records that never repeat are not copied.
+      entry.lastSeen = message.timestamp;
+      if (entry.repeats == 0)
+      {
+        entry.sample = std::move(message);
+      }
+      ++entry.repeats;
+      return true;
+    }
+    if (victim == nullptr ||
+        (entry.repeats == 0) > (victim->repeats == 0) ||
+        ((entry.repeats == 0) == (victim->repeats == 0) && entry.windowEnd < victim->windowEnd))
+      victim = &entry;
+  }
+
+  if (free == nullptr)
+  {
+    release(*victim, out);
+    free = victim;
+  }
+  free->used = true;
+  free->hash = hash;
+  free->windowEnd = now + window_;
+  free->repeats = 0;
+  free->firstSeen = message.timestamp;
+  free->lastSeen = message.timestamp;
+  nextExpiry_ = std::min(nextExpiry_, free->windowEnd);
+  return false;
+}
+
+void Deduplicator::expire(std::chrono::steady_clock::time_point now, std::vector<LogMessage> &out)
+{
+  if (now < nextExpiry_)
+  {
+    return;
+  }
+  nextExpiry_ = std::chrono::steady_clock::time_point::max();
+  for (auto &entry : entries_)
+  {
+    if (!entry.used)
+      continue;
+    if (entry.windowEnd <= now)
+    {
+      release(entry, out);
+    }
+    else
+    {
+      nextExpiry_ = std::min(nextExpiry_, entry.windowEnd);
+    }
+  }
+}
+
+void Deduplicator::drain(std::vector<LogMessage> &out)
+{
+  for (auto &entry : entries_)
+  {
+    if (entry.used)
+    {
+      release(entry, out);
+    }
+  }
+  nextExpiry_ = std::chrono::steady_clock::time_point::max();
+}
+
+void Deduplicator::clear()
+{
+  for (auto &entry : entries_)
+  {
+    entry.used = false;
+    entry.sample = LogMessage();
+  }
+  nextExpiry_ = std::chrono::steady_clock::time_point::max();
+}
+
+void Deduplicator::release(Entry &entry, std::vector<LogMessage> &out)
+{
+  if (entry.repeats > 0)
+  {
+    LogMessage summary = std::move(entry.sample);
+    summary.attributes.emplace_back(Key("repeat_count"), entry.repeats);
+    summary.attributes.emplace_back(Key("first_seen"), entry.firstSeen);
+    summary.attributes.emplace_back(Key("last_seen"), entry.lastSeen);
+    summary.timestamp = entry.lastSeen;
+    out.push_back(std::move(summary));
+  }
+  entry.used = false;
+  entry.sample = LogMessage();
+}
+
+uint64_t Deduplicator::hashRecord(const LogMessage &message)
+{
+  uint64_t hash = 14695981039346656037ull;
+  auto level = static_cast<unsigned char>(message.level);
+  hash = mix(hash, &level, 1);
+  hash = mix(hash, message.body.data(), message.body.size());
+  for (auto &attr : message.attributes)
+  {
+    uint64_t keyHash = attr.hash();
+    hash = mix(hash, &keyHash, sizeof(keyHash));
+    hash = mixValue(hash, attr.value);
+  }
+  const void *bound = message.bound.get();
+  hash = mix(hash, &bound, sizeof(bound));
+  const void *callsite = message.callsite;
+  return mix(hash, &callsite, sizeof(callsite));
+}
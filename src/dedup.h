@@ -0,0 +1,65 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <vector>
+#include <chrono>
+#include <cstdint>
+
+#include "log_message.h"
+
+// Collapses repeated records within a time window. The first occurrence of a
+// record passes through; later ones with the same body, level and attributes
+// (compared by a 64-bit hash) are only counted until the window closes, when
+// a single summary record with repeat_count, first_seen and last_seen is
+// emitted in their place. Entries
+// live in a fixed-size table, so memory stays bounded however many distinct
+// records arrive; a full table evicts the oldest entry early.
+//
+// Not thread-safe. The Exporter only uses it on the batcher thread while
+// holding its queue lock.
+class Deduplicator
+{
+public:
+  Deduplicator(std::chrono::milliseconds window, size_t capacity);
+
+  // Returns true if message repeats one seen within the window, in which case
+  // it has been counted, possibly moved from, and must be dropped. Summaries
+  // of entries evicted to make room are appended to out.
+  bool absorb(LogMessage &message, std::chrono::steady_clock::time_point now, std::vector<LogMessage> &out);
+
+  // Appends summaries for entries whose window has closed by now.
+  void expire(std::chrono::steady_clock::time_point now, std::vector<LogMessage> &out);
+
+  // Appends summaries for every entry with repeats and forgets them all.
+  void drain(std::vector<LogMessage> &out);
+
+  // Forgets every entry without emitting anything.
+  void clear();
+
+  // When the next entry's window closes, or time_point::max() if none.
+  std::chrono::steady_clock::time_point nextExpiry() const { return nextExpiry_; }
+
+private:
+  // Linear probing is limited to this many slots.
+  static constexpr size_t kProbe = 8;
+
+  struct Entry
+  {
+    bool used = false;
+    uint64_t hash = 0;
+    std::chrono::steady_clock::time_point windowEnd;
+    uint64_t repeats = 0;
+    std::chrono::system_clock::time_point firstSeen;
+    std::chrono::system_clock::time_point lastSeen;
+    LogMessage sample;
+  };
+
+  std::chrono::milliseconds window_;
+  std::vector<Entry> entries_;
+  std::chrono::steady_clock::time_point nextExpiry_;
+
+  static uint64_t hashRecord(const LogMessage &message);
+  void release(Entry &entry, std::vector<LogMessage> &out);
+};
+
+#endif // DEDUP_H
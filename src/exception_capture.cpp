@@ -0,0 +1,245 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <cstdlib>
+#include <cstdint>
+#include <typeinfo>
+#include <exception>
+
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define VIGILANT_HAVE_BACKTRACE 1
+#endif
+#if __has_include(<dlfcn.h>)
+#include <dlfcn.h>
+#define VIGILANT_HAVE_DLADDR 1
+#endif
+#if __has_include(<cxxabi.h>)
+#include <cxxabi.h>
+#define VIGILANT_HAVE_DEMANGLE 1
+#endif
+
+#include "exception_capture.h"
+#include "json_writer.h"
+
+namespace
+{
+  const size_t kMaxCauses = 16;
+  const int kMaxFrames = 64;
+  // Resolved frames kept before the cache is cleared.
+  const size_t kSymbolCacheLimit = 4096;
+
+  std::mutex cacheMutex;
+  std::map<const char *, std::string> typeNames;
+  std::unordered_map<void *, std::string> symbols;
+
+  std::string demangle(const char *name)
+  {
+#ifdef VIGILANT_HAVE_DEMANGLE
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (demangled)
+    {
+      std::string result(demangled);
+      std::free(demangled);
+      return result;
+    }
+#endif
+    return name;
+  }
+
+  std::string hex(uintptr_t value)
+  {
+    static const char digits[] = "0123456789abcdef";
+    std::string out = "0x";
+    int shift = 60;
+    while (shift > 0 && (value >> shift) == 0)
+    {
+      shift -= 4;
+    }
+    for (; shift >= 0; shift -= 4)
+    {
+      out.push_back(digits[(value >> shift) & 0xF]);
+    }
+    return out;
+  }
+
+  // std::throw_with_nested throws an unnamed library type derived from the
+  // user's exception; report the type that was wrapped.
+  std::string unwrapNested(std::string name)
+  {
+    static const std::string wrapper = "std::_Nested_exception<";
+    if (name.compare(0, wrapper.size(), wrapper) == 0 && name.back() == '>')
+    {
+      name = name.substr(wrapper.size(), name.size() - wrapper.size() - 1);
+    }
+    return name;
+  }
+
+  // Called with cacheMutex held.
+  const std::string &typeName(const char *mangled)
+  {
+    static const std::string unknown = "unknown";
+    if (!mangled)
+    {
+      return unknown;
+    }
+    auto it = typeNames.find(mangled);
+    if (it == typeNames.end())
+    {
+      it = typeNames.emplace(mangled, unwrapNested(demangle(mangled))).first;
+    }
+    return it->second;
+  }
+
+  std::string resolve(void *address)
+  {
+#ifdef VIGILANT_HAVE_DLADDR
+    // A return address points just past the call, which may be the first
+    // byte of the next function.
+    Dl_info info;
+    if (dladdr(static_cast<char *>(address) - 1, &info) && info.dli_fname)
+    {
+      std::string module = info.dli_fname;
+      size_t slash = module.rfind('/');
+      if (slash != std::string::npos)
+      {
+        module.erase(0, slash + 1);
+      }
+      if (info.dli_sname)
+      {
+        return demangle(info.dli_sname) + "+" +
+               hex(reinterpret_cast<uintptr_t>(address) - reinterpret_cast<uintptr_t>(info.dli_saddr)) +
+               " (" + module + ")";
+      }
+      // Not an exported symbol: the module offset can be fed to addr2line.
+      return module + "+" + hex(reinterpret_cast<uintptr_t>(address) - reinterpret_cast<uintptr_t>(info.dli_fbase));
+    }
+#endif
+    return hex(reinterpret_cast<uintptr_t>(address));
+  }
+
+  // Called with cacheMutex held.
+  const std::string &symbol(void *address)
+  {
+    auto it = symbols.find(address);
+    if (it == symbols.end())
+    {
+      if (symbols.size() >= kSymbolCacheLimit)
+      {
+        symbols.clear();
+      }
+      it = symbols.emplace(address, resolve(address)).first;
+    }
+    return it->second;
+  }
+
+  void addCauses(ExceptionInfo &info, const std::exception &err)
+  {
+    info.causes.push_back({typeid(err).name(), err.what()});
+    auto nested = dynamic_cast<const std::nested_exception *>(&err);
+    if (!nested || !nested->nested_ptr() || info.causes.size() >= kMaxCauses)
+    {
+      return;
+    }
+    try
+    {
+      std::rethrow_exception(nested->nested_ptr());
+    }
+    catch (const std::exception &inner)
+    {
+      addCauses(info, inner);
+    }
+    catch (...)
+    {
+      info.causes.push_back({nullptr, std::string()});
+    }
+  }
+}
+
+std::shared_ptr<const ExceptionInfo> captureException(const std::exception &err, int skipFrames)
+{
+  auto info = std::make_shared<ExceptionInfo>();
+  addCauses(*info, err);
+#ifdef VIGILANT_HAVE_BACKTRACE
+  void *frames[kMaxFrames];
+  int count = backtrace(frames, kMaxFrames);
+  // The first frame is this function.
+  int first = 1 + skipFrames;
+  if (count > first)
+  {
+    info->frames.assign(frames + first, frames + count);
+  }
+#endif
+  return info;
+}
+
+void appendException(std::string &out, const ExceptionInfo &info, bool &first)
+{
+  if (info.causes.empty())
+  {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  if (!first)
+  {
+    out.push_back(',');
+  }
+  first = false;
+  out.append("\"exception.type\":");
+  appendJsonString(out, typeName(info.causes[0].type));
+
+  if (info.causes.size() > 1)
+  {
+    out.append(",\"exception.causes\":[");
+    for (size_t i = 1; i < info.causes.size(); ++i)
+    {
+      if (i > 1)
+      {
+        out.push_back(',');
+      }
+      out.append("{\"type\":");
+      appendJsonString(out, typeName(info.causes[i].type));
+      out.append(",\"message\":");
+      appendJsonString(out, info.causes[i].message);
+      out.push_back('}');
+    }
+    out.push_back(']');
+  }
+
+  if (info.frames.empty())
+  {
+    return;
+  }
+  std::string trace;
+  for (size_t i = 0; i < info.frames.size(); ++i)
+  {
+    if (i > 0)
+    {
+      trace.push_back('\n');
+    }
+    trace.append(symbol(info.frames[i]));
+  }
+  out.append(",\"exception.stacktrace\":");
+  appendJsonString(out, trace);
+}
+
+void lockExceptionCacheForFork()
+{
+  cacheMutex.lock();
+}
+
+void unlockExceptionCacheForFork()
+{
+  cacheMutex.unlock();
+}
+
+void resetExceptionCacheInChild()
+{
+  // The cache was consistent when the lock was taken, and the addresses it
+  // maps are the same in the child.
+  cacheMutex.unlock();
+}
@@ -0,0 +1,38 @@
+#ifndef EXCEPTION_CAPTURE_H
+#define EXCEPTION_CAPTURE_H
+
+#include <string>
+#include <memory>
+#include <exception>
+
+#include "log_message.h"
+
+// Keeps a function in its own stack frame, for callers that count frames.
+#if defined(__GNUC__)
+#define VIGILANT_NOINLINE __attribute__((noinline))
+#else
+#define VIGILANT_NOINLINE
+#endif
+
+// Records the dynamic type of err, the chain of exceptions nested in it
+// through std::throw_with_nested, and the return addresses above the
+// innermost skipFrames callers. Nothing is demangled or symbolized here, so
+// this stays cheap on the logging thread.
+VIGILANT_NOINLINE std::shared_ptr<const ExceptionInfo> captureException(const std::exception &err, int skipFrames);
+
+// Appends the exception as "exception.type", "exception.causes" and
+// "exception.stacktrace" members of an object being written to out. first
+// says whether nothing has been written to the object yet, and is cleared
+// once a member is. Type names are demangled and frames resolved to
+// "function+0xoffset (module)" through a process-wide cache.
+void appendException(std::string &out, const ExceptionInfo &info, bool &first);
+
+// fork() support: the cache lock is held across fork(), so that the child
+// never inherits it from a batcher that was in the middle of an encode.
+// The lock is process-wide, so these are called once per fork rather than
+// once per Exporter.
+void lockExceptionCacheForFork();
+void unlockExceptionCacheForFork();
+void resetExceptionCacheInChild();
+
+#endif // EXCEPTION_CAPTURE_H
@@ -0,0 +1,1224 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <deque>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <ctime>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <iomanip>
+#include <algorithm>
+
+#include <new>
+#include <cstring>
+#include <cerrno>
+#include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#include "exporter.h"
+#include "json_writer.h"
+#include "dedup.h"
+#include "tracer.h"
+#include "exception_capture.h"
+#include "transport.h"
+
+namespace
+{
+  std::mutex forkRegistryMutex;
+  std::vector<Exporter *> forkRegistry;
+  std::once_flag forkHandlersOnce;
+
+  // Attributes are dropped from a crash log line that would otherwise have
+  // room for less than this much of its body.
+  const size_t kMinCrashBody = 256;
+
+  // How long a sink gets to return from send() after cancel() before a
+  // bounded shutdown abandons it.
+  const std::chrono::milliseconds kCancelGrace(1000);
+}
+
+Exporter::Exporter(ExporterOptions options)
+    : token_(std::move(options.token)),
+      sink_(std::move(options.sink)),
+      maxBatchSize_(options.maxBatchSize),
+      batchInterval_(options.batchInterval),
+      adaptiveBatching_(options.adaptiveBatching),
+      minBatchSize_(std::max<size_t>(1, std::min(options.minBatchSize, options.maxBatchSize))),
+      minBatchInterval_(options.minBatchInterval),
+      maxBatchInterval_(std::max(options.maxBatchInterval, options.minBatchInterval)),
+      targetLatency_(options.targetLatency),
+      batchSizeLimit_(options.maxBatchSize),
+      currentInterval_(options.batchInterval),
+      arrivalRate_(0.0),
+      encodeNanos_(0.0),
+      uploadNanos_(0),
+      clock_(options.clock ? std::move(options.clock) : &std::chrono::steady_clock::now),
+      workerName_(std::move(options.workerName)),
+      workerCpus_(std::move(options.workerCpus)),
+      workerNice_(options.workerNice),
+      workerSchedPolicy_(options.workerSchedPolicy),
+      workerSchedPriority_(options.workerSchedPriority),
+      executor_(std::move(options.executor)),
+      destroyTimeout_(options.destroyTimeout),
+      stopWorker_(false),
+      abandon_(false),
+      flushRequested_(false),
+      periodicChanged_(false),
+      started_(false),
+      prewarmRequested_(false),
+      runningLoops_(0),
+      lifetime_(std::make_shared<Lifetime>()),
+      enqueuedCount_(0),
+      settledCount_(0),
+      failedCount_(0),
+      crashLog_(),
+      sampler_(options.sampling),
+      dedup_(options.dedupWindow.count() > 0 ? new Deduplicator(options.dedupWindow, options.dedupCapacity) : nullptr),
+      metrics_(),
+      metricsInterval_(options.metricsInterval),
+      tracer_(new Tracer()),
+      traceInterval_(options.traceInterval),
+      encoderDone_(false)
+{
+  if (!options.crashLogPath.empty())
+  {
+    crashLog_.reset(new CrashLog(options.crashLogPath, options.crashLogCapacity));
+    replayCrashLog();
+  }
+
+  // Threads are started by the first record or prewarm(), unless there is a
+  // crash log to upload.
+  bool start = false;
+  if (!payloadQueue_.empty())
+  {
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    start = startLocked();
+  }
+  if (start)
+  {
+    startThreads();
+  }
+  registerForFork(this);
+}
+
+Exporter::~Exporter()
+{
+  unregisterForFork(this);
+  shutdown(destroyTimeout_);
+}
+
+std::chrono::steady_clock::time_point Exporter::now() const
+{
+  return clock_();
+}
+
+bool Exporter::startLocked()
+{
+  if (started_ || stopWorker_)
+  {
+    return false;
+  }
+  started_ = true;
+  // Counted here rather than when the loops start, so that a shutdown()
+  // that gets queueMutex_ next waits for loops that do not exist yet.
+  // Nothing else touches the count until they do.
+  runningLoops_ = 2;
+  return true;
+}
+
+void Exporter::startThreads()
+{
+  if (executor_)
+  {
+    executor_([this]()
+              { runLoop(&Exporter::runSender); });
+    executor_([this]()
+              { runLoop(&Exporter::runBatcher); });
+    return;
+  }
+
+  // The loops cannot finish before this returns, so joinThreads() never
+  // sees the handles half-assigned.
+  std::lock_guard<std::mutex> lock(loopsMutex_);
+  senderThread_ = std::thread([this]()
+                              {
+                                applyThreadPlacement("send");
+                                runLoop(&Exporter::runSender); });
+  workerThread_ = std::thread([this]()
+                              {
+                                applyThreadPlacement("batch");
+                                runLoop(&Exporter::runBatcher); });
+}
+
+bool Exporter::joinThreads(std::chrono::milliseconds timeout)
+{
+  {
+    std::unique_lock<std::mutex> lock(loopsMutex_);
+    auto done = [&]()
+    { return runningLoops_ == 0; };
+    if (timeout == std::chrono::milliseconds::max())
+    {
+      loopsDone_.wait(lock, done);
+    }
+    else if (!loopsDone_.wait_for(lock, timeout, done))
+    {
+      return false;
+    }
+  }
+
+  if (workerThread_.joinable())
+  {
+    workerThread_.join();
+  }
+  if (senderThread_.joinable())
+  {
+    senderThread_.join();
+  }
+  return true;
+}
+
+void Exporter::detachLoops()
+{
+  // Waits for the batcher to finish, which it does promptly once abandoned,
+  // and for the sender to be inside the sink.
+  std::unique_lock<std::shared_mutex> exclusive(lifetime_->mutex);
+  {
+    std::lock_guard<std::mutex> lock(loopsMutex_);
+    lifetime_->detached = runningLoops_ != 0;
+  }
+  exclusive.unlock();
+
+  if (!lifetime_->detached)
+  {
+    joinThreads(std::chrono::milliseconds::max());
+    return;
+  }
+  std::cerr << "Sink did not return from send() after cancel(); abandoning it" << std::endl;
+  if (workerThread_.joinable())
+  {
+    workerThread_.detach();
+  }
+  if (senderThread_.joinable())
+  {
+    senderThread_.detach();
+  }
+}
+
+void Exporter::abandon()
+{
+  abandon_ = true;
+  sink_->cancel();
+  condition_.notify_all();
+  payloadSpace_.notify_all();
+  payloadReady_.notify_all();
+}
+
+void Exporter::runLoop(void (Exporter::*loop)(LoopLock &))
+{
+  std::shared_ptr<Lifetime> lifetime = lifetime_;
+  LoopLock held(lifetime->mutex);
+  (this->*loop)(held);
+  if (lifetime->detached)
+  {
+    return;
+  }
+
+  // Notify under the lock: once joinThreads() sees zero the Exporter may be
+  // destroyed.
+  std::lock_guard<std::mutex> lock(loopsMutex_);
+  --runningLoops_;
+  loopsDone_.notify_all();
+}
+
+void Exporter::applyThreadPlacement(const char *role)
+{
+#if defined(__linux__)
+  pthread_t self = pthread_self();
+
+  if (!workerName_.empty())
+  {
+    std::string name = (workerName_ + "-" + role).substr(0, 15);
+    pthread_setname_np(self, name.c_str());
+  }
+
+  if (!workerCpus_.empty())
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu : workerCpus_)
+    {
+      if (cpu >= 0 && cpu < CPU_SETSIZE)
+      {
+        CPU_SET(cpu, &cpus);
+      }
+    }
+    int rc = pthread_setaffinity_np(self, sizeof(cpus), &cpus);
+    if (rc != 0)
+    {
+      std::cerr << "Failed to set logger thread affinity: " << std::strerror(rc) << std::endl;
+    }
+  }
+
+  if (workerSchedPolicy_ >= 0)
+  {
+    struct sched_param param;
+    param.sched_priority = workerSchedPriority_;
+    int rc = pthread_setschedparam(self, workerSchedPolicy_, &param);
+    if (rc != 0)
+    {
+      std::cerr << "Failed to set logger thread scheduling: " << std::strerror(rc) << std::endl;
+    }
+  }
+
+  // On Linux the nice value belongs to the thread, not the process.
+  if (workerNice_ != 0)
+  {
+    if (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), workerNice_) != 0)
+    {
+      std::cerr << "Failed to set logger thread nice value: " << std::strerror(errno) << std::endl;
+    }
+  }
+#else
+  (void)role;
+#endif
+}
+
+void Exporter::enqueue(LogMessage message)
+{
+  std::string crashLine;
+  if (crashLog_)
+  {
+    encodeCrashLine(crashLine, message);
+  }
+
+  bool start;
+  {
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    if (stopWorker_)
+    {
+      return;
+    }
+    start = startLocked();
+    logQueue_.push(Pending{std::move(message), now()});
+    ++enqueuedCount_;
+    if (crashLog_)
+    {
+      crashLog_->record(enqueuedCount_, crashLine);
+    }
+  }
+  if (start)
+  {
+    startThreads();
+  }
+  condition_.notify_all();
+}
+
+void Exporter::prewarm()
+{
+  bool start;
+  {
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    if (stopWorker_)
+    {
+      return;
+    }
+    prewarmRequested_ = true;
+    start = startLocked();
+  }
+  if (start)
+  {
+    startThreads();
+  }
+  {
+    std::lock_guard<std::mutex> lock(payloadMutex_);
+  }
+  payloadReady_.notify_all();
+}
+
+Counter Exporter::counter(const std::string &name, const std::vector<Attribute> &attrs)
+{
+  Counter counter = metrics_.counter(name, attrs);
+  startPeriodic();
+  return counter;
+}
+
+Gauge Exporter::gauge(const std::string &name, const std::vector<Attribute> &attrs)
+{
+  Gauge gauge = metrics_.gauge(name, attrs);
+  startPeriodic();
+  return gauge;
+}
+
+Histogram Exporter::histogram(const std::string &name, const std::vector<double> &bounds, const std::vector<Attribute> &attrs)
+{
+  Histogram histogram = metrics_.histogram(name, bounds, attrs);
+  startPeriodic();
+  return histogram;
+}
+
+void Exporter::startPeriodic()
+{
+  bool start;
+  {
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    if (stopWorker_)
+    {
+      return;
+    }
+    start = startLocked();
+    // The batcher may be waiting with no deadline; it has to recompute its
+    // wake-up time to start keeping the metrics and traces schedules.
+    periodicChanged_ = true;
+  }
+  if (start)
+  {
+    startThreads();
+  }
+  condition_.notify_all();
+}
+
+size_t Exporter::flush(std::chrono::milliseconds timeout)
+{
+  uint64_t target;
+  uint64_t failedBefore = failedCount_.load();
+  uint64_t settledBefore = settledCount_.load();
+  {
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    target = enqueuedCount_;
+    flushRequested_ = true;
+  }
+  condition_.notify_all();
+
+  waitForSettled(target, timeout);
+
+  uint64_t settled = std::min<uint64_t>(settledCount_.load(), target);
+  uint64_t failed = failedCount_.load() - failedBefore;
+  uint64_t undelivered = (target - settled) + failed;
+  return static_cast<size_t>(std::min<uint64_t>(undelivered, target - std::min(settledBefore, target)));
+}
+
+size_t Exporter::shutdown(std::chrono::milliseconds timeout)
+{
+  uint64_t target;
+  uint64_t failedBefore = failedCount_.load();
+  reportSuppressed();
+  {
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    if (stopWorker_)
+    {
+      return 0;
+    }
+    stopWorker_ = true;
+    target = enqueuedCount_;
+  }
+  condition_.notify_all();
+
+  auto started = std::chrono::steady_clock::now();
+  if (!waitForSettled(target, timeout))
+  {
+    abandon();
+  }
+
+  if (timeout == std::chrono::milliseconds::max())
+  {
+    joinThreads(timeout);
+  }
+  else
+  {
+    // The sender may still be busy with a payload that settles nothing,
+    // such as metrics.
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    if (!joinThreads(std::max(timeout - elapsed, std::chrono::milliseconds(0))))
+    {
+      abandon();
+      if (!joinThreads(kCancelGrace))
+      {
+        detachLoops();
+      }
+    }
+  }
+
+  // Records in a payload the sink was abandoned with are never settled.
+  uint64_t unsettled = target - std::min<uint64_t>(settledCount_.load(), target);
+  return static_cast<size_t>(failedCount_.load() - failedBefore + unsettled);
+}
+
+void Exporter::settle(size_t messages, bool delivered)
+{
+  if (messages == 0)
+  {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(progressMutex_);
+    if (!delivered)
+    {
+      failedCount_ += messages;
+    }
+    settledCount_ += messages;
+    if (crashLog_)
+    {
+      crashLog_->markSettled(settledCount_);
+    }
+  }
+  progress_.notify_all();
+}
+
+bool Exporter::waitForSettled(uint64_t target, std::chrono::milliseconds timeout)
+{
+  std::unique_lock<std::mutex> lock(progressMutex_);
+  auto done = [&]()
+  { return settledCount_.load() >= target; };
+
+  if (timeout == std::chrono::milliseconds::max())
+  {
+    progress_.wait(lock, done);
+    return true;
+  }
+  return progress_.wait_for(lock, timeout, done);
+}
+
+void Exporter::runBatcher(LoopLock &)
+{
+  using std::chrono::steady_clock;
+
+  std::vector<LogMessage> batch;
+  batch.reserve(maxBatchSize_);
+  // Records taken off the queue for the current batch. With deduplication
+  // some of them are only counted, so this can exceed batch.size(); summary
+  // records, which were never enqueued, are not included.
+  size_t pulled = 0;
+
+  // A batch is due batchInterval after its oldest record was enqueued, so a
+  // steady trickle of new records can't keep pushing the send back.
+  auto batchDeadline = steady_clock::time_point::max();
+  auto lastTune = now();
+  size_t arrived = 0;
+
+  // With sampling on, the batcher also wakes up to report what was
+  // suppressed.
+  auto nextReport = sampler_.enabled() ? now() + sampler_.reportInterval() : steady_clock::time_point::max();
+  // Each schedule starts when its first instrument or span appears.
+  bool metricsActive = false;
+  bool spansActive = false;
+  auto nextMetrics = steady_clock::time_point::max();
+  auto nextSpans = steady_clock::time_point::max();
+
+  while (true)
+  {
+    std::unique_lock<std::mutex> lock(queueMutex_);
+    auto ready = [&]()
+    { return !logQueue_.empty() || stopWorker_ || flushRequested_ || periodicChanged_; };
+    periodicChanged_ = false;
+    if (!metricsActive && !metrics_.empty())
+    {
+      metricsActive = true;
+      nextMetrics = now() + metricsInterval_;
+    }
+    if (!spansActive && tracer_->active())
+    {
+      spansActive = true;
+      nextSpans = now() + traceInterval_;
+    }
+    bool pending = pulled > 0 || !batch.empty();
+    auto wakeAt = std::min(pending ? batchDeadline : steady_clock::time_point::max(), nextReport);
+    if (dedup_)
+    {
+      wakeAt = std::min(wakeAt, dedup_->nextExpiry());
+    }
+    wakeAt = std::min(wakeAt, std::min(nextMetrics, nextSpans));
+    if (wakeAt == steady_clock::time_point::max())
+    {
+      condition_.wait(lock, ready);
+    }
+    else
+    {
+      auto current = now();
+      if (current < wakeAt)
+      {
+        condition_.wait_for(lock, wakeAt - current, ready);
+      }
+    }
+
+    if (abandon_)
+    {
+      size_t dropped = pulled + logQueue_.size();
+      std::queue<Pending>().swap(logQueue_);
+      if (dedup_)
+      {
+        dedup_->clear();
+      }
+      lock.unlock();
+      batch.clear();
+      settle(dropped, false);
+      break;
+    }
+
+    if (stopWorker_ && logQueue_.empty())
+    {
+      if (dedup_)
+      {
+        dedup_->drain(batch);
+      }
+      lock.unlock();
+      sendMetrics();
+      sendSpans();
+      sendBatch(batch, pulled);
+      break;
+    }
+
+    while (!logQueue_.empty() && batch.size() < batchSizeLimit_)
+    {
+      Pending &pending = logQueue_.front();
+      if (pulled == 0 && batch.empty())
+      {
+        batchDeadline = pending.enqueuedAt + currentInterval_;
+      }
+      ++pulled;
+      ++arrived;
+      if (!dedup_ || !dedup_->absorb(pending.message, pending.enqueuedAt, batch))
+      {
+        batch.push_back(std::move(pending.message));
+      }
+      logQueue_.pop();
+    }
+
+    bool flushNow = false;
+    if (flushRequested_ && logQueue_.empty())
+    {
+      flushRequested_ = false;
+      flushNow = true;
+    }
+
+    if (dedup_)
+    {
+      // Summaries are sent with the current batch, or start one of their
+      // own.
+      bool wasPending = pulled > 0 || !batch.empty();
+      if (flushNow)
+      {
+        dedup_->drain(batch);
+      }
+      else
+      {
+        dedup_->expire(now(), batch);
+      }
+      if (!wasPending && !batch.empty())
+      {
+        batchDeadline = now() + currentInterval_;
+      }
+    }
+    lock.unlock();
+
+    if (flushNow || now() >= nextMetrics)
+    {
+      sendMetrics();
+      if (metricsActive)
+      {
+        nextMetrics = now() + metricsInterval_;
+      }
+    }
+    if (flushNow || now() >= nextSpans)
+    {
+      sendSpans();
+      if (spansActive)
+      {
+        nextSpans = now() + traceInterval_;
+      }
+    }
+
+    bool sent = false;
+    if ((pulled > 0 || !batch.empty()) && (batch.size() >= batchSizeLimit_ || flushNow || now() >= batchDeadline))
+    {
+      sendBatch(batch, pulled);
+      pulled = 0;
+      batchDeadline = steady_clock::time_point::max();
+      sent = true;
+    }
+
+    if (sent && adaptiveBatching_)
+    {
+      auto current = now();
+      tuneBatching(arrived, current - lastTune);
+      lastTune = current;
+      arrived = 0;
+    }
+
+    if (now() >= nextReport)
+    {
+      reportSuppressed();
+      nextReport = now() + sampler_.reportInterval();
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(payloadMutex_);
+    encoderDone_ = true;
+  }
+  payloadReady_.notify_all();
+}
+
+void Exporter::runSender(LoopLock &held)
+{
+  // Used after sink calls, which may return after the Exporter is gone.
+  std::shared_ptr<Lifetime> lifetime = lifetime_;
+  std::shared_ptr<Sink> sink = sink_;
+
+  while (true)
+  {
+    std::unique_lock<std::mutex> lock(payloadMutex_);
+    payloadReady_.wait(lock, [&]()
+                       { return !payloadQueue_.empty() || encoderDone_ || prewarmRequested_; });
+
+    if (prewarmRequested_.exchange(false))
+    {
+      lock.unlock();
+      held.unlock();
+      sink->prewarm();
+      held.lock();
+      if (lifetime->detached)
+      {
+        return;
+      }
+      continue;
+    }
+
+    if (abandon_)
+    {
+      size_t dropped = 0;
+      for (auto &payload : payloadQueue_)
+      {
+        dropped += payload.messages;
+      }
+      payloadQueue_.clear();
+      lock.unlock();
+      payloadSpace_.notify_all();
+      settle(dropped, false);
+      if (encoderDone_)
+      {
+        break;
+      }
+      continue;
+    }
+
+    if (payloadQueue_.empty())
+    {
+      break;
+    }
+
+    Payload payload = std::move(payloadQueue_.front());
+    payloadQueue_.pop_front();
+    lock.unlock();
+    payloadSpace_.notify_one();
+
+    if (payload.body.empty())
+    {
+      settle(payload.messages, true);
+      continue;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    held.unlock();
+    bool delivered = sink->send(payload.body);
+    held.lock();
+    if (lifetime->detached)
+    {
+      return;
+    }
+    if (adaptiveBatching_)
+    {
+      int64_t took = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - started)
+                         .count();
+      int64_t previous = uploadNanos_.load(std::memory_order_relaxed);
+      uploadNanos_.store(previous == 0 ? took : (previous * 4 + took) / 5, std::memory_order_relaxed);
+    }
+    settle(payload.messages, delivered);
+  }
+}
+
+void Exporter::sendBatch(std::vector<LogMessage> &batch, size_t messages)
+{
+  if (batch.empty() && messages == 0)
+  {
+    return;
+  }
+
+  auto encodeStart = std::chrono::steady_clock::now();
+
+  // A batch whose records were all collapsed into pending summaries still
+  // goes through the payload queue, with an empty body, so that they are
+  // settled in order.
+  Payload payload{std::string(), messages};
+  std::string &body = payload.body;
+  if (batch.empty())
+  {
+    queuePayload(std::move(payload));
+    return;
+  }
+  body.append("{\"token\":");
+  appendJsonString(body, token_);
+  body.append(",\"type\":\"logs\",\"logs\":[");
+  for (size_t i = 0; i < batch.size(); ++i)
+  {
+    if (i > 0)
+    {
+      body.push_back(',');
+    }
+    encodeRecord(body, batch[i]);
+  }
+  body.append("]}");
+  batch.clear();
+
+  if (adaptiveBatching_)
+  {
+    double took = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                          std::chrono::steady_clock::now() - encodeStart)
+                                          .count());
+    encodeNanos_ = encodeNanos_ == 0.0 ? took : encodeNanos_ * 0.8 + took * 0.2;
+  }
+
+  queuePayload(std::move(payload));
+}
+
+void Exporter::queuePayload(Payload payload)
+{
+  {
+    std::unique_lock<std::mutex> lock(payloadMutex_);
+    payloadSpace_.wait(lock, [&]()
+                       { return payloadQueue_.size() < kPayloadSlots || abandon_; });
+    if (abandon_)
+    {
+      lock.unlock();
+      settle(payload.messages, false);
+      return;
+    }
+    payloadQueue_.push_back(std::move(payload));
+  }
+  payloadReady_.notify_one();
+}
+
+void Exporter::tuneBatching(size_t arrived, std::chrono::steady_clock::duration elapsed)
+{
+  using std::chrono::duration_cast;
+  using std::chrono::milliseconds;
+  using std::chrono::nanoseconds;
+
+  double seconds = std::chrono::duration<double>(elapsed).count();
+  if (seconds <= 0.0)
+  {
+    return;
+  }
+  double rate = static_cast<double>(arrived) / seconds;
+  arrivalRate_ = arrivalRate_ == 0.0 ? rate : arrivalRate_ * 0.8 + rate * 0.2;
+
+  // Whatever part of the latency target is not spent encoding and uploading
+  // can be spent waiting for more records. Waiting as long as allowed keeps
+  // the request rate down.
+  auto overhead = nanoseconds(static_cast<int64_t>(encodeNanos_)) + nanoseconds(uploadNanos_.load(std::memory_order_relaxed));
+  auto budget = duration_cast<milliseconds>(targetLatency_ - overhead);
+  currentInterval_ = std::min(std::max(budget, minBatchInterval_), maxBatchInterval_);
+
+  // Size batches for what arrives in one interval, or during one upload if
+  // that takes longer, with headroom for bursts. Anything larger only adds
+  // memory; anything smaller splits the interval's traffic into several
+  // requests.
+  auto window = std::max<std::chrono::nanoseconds>(currentInterval_, nanoseconds(uploadNanos_.load(std::memory_order_relaxed)));
+  double expected = arrivalRate_ * std::chrono::duration<double>(window).count() * 1.5;
+  size_t size = expected >= static_cast<double>(maxBatchSize_) ? maxBatchSize_ : static_cast<size_t>(expected);
+  batchSizeLimit_ = std::min(std::max(size, minBatchSize_), maxBatchSize_);
+}
+
+void Exporter::reportSuppressed()
+{
+  if (!sampler_.enabled())
+  {
+    return;
+  }
+  auto counts = sampler_.takeSuppressed();
+  uint64_t total = counts[0] + counts[1] + counts[2] + counts[3];
+  if (total == 0)
+  {
+    return;
+  }
+
+  LogMessage report;
+  report.timestamp = std::chrono::system_clock::now();
+  report.body = "Suppressed " + std::to_string(total) + " log records by sampling";
+  report.level = LogLevel::Warn;
+  report.attributes.emplace_back(Key("sampling.suppressed"), total);
+  const Key perLevel[] = {Key("sampling.suppressed.debug"), Key("sampling.suppressed.info"),
+                          Key("sampling.suppressed.warning"), Key("sampling.suppressed.error")};
+  for (size_t i = 0; i < counts.size(); ++i)
+  {
+    if (counts[i] > 0)
+    {
+      report.attributes.emplace_back(perLevel[i], counts[i]);
+    }
+  }
+  enqueue(std::move(report));
+}
+
+void Exporter::sendMetrics()
+{
+  if (metrics_.empty())
+  {
+    return;
+  }
+  std::string items;
+  if (metrics_.collect(items) == 0)
+  {
+    return;
+  }
+
+  // Metrics are not records, so the payload settles nothing.
+  Payload payload{std::string(), 0};
+  std::string &body = payload.body;
+  body.append("{\"token\":");
+  appendJsonString(body, token_);
+  body.append(",\"type\":\"metrics\",\"metrics\":[");
+  body.append(items);
+  body.append("]}");
+  queuePayload(std::move(payload));
+}
+
+std::shared_ptr<SpanRing> Exporter::spanRing()
+{
+  // The batcher only keeps the traces schedule once the tracer is active.
+  bool first = !tracer_->active();
+  std::shared_ptr<SpanRing> ring = tracer_->ringForThisThread();
+  if (first)
+  {
+    startPeriodic();
+  }
+  return ring;
+}
+
+const std::string *Exporter::spanService(const std::string &name)
+{
+  return tracer_->internService(name);
+}
+
+void Exporter::sendSpans()
+{
+  if (!tracer_->active())
+  {
+    return;
+  }
+  std::string items;
+  size_t spans = tracer_->collect(items);
+  uint64_t dropped = tracer_->takeDropped();
+  if (spans == 0 && dropped == 0)
+  {
+    return;
+  }
+
+  // Like metrics, spans settle nothing.
+  Payload payload{std::string(), 0};
+  std::string &body = payload.body;
+  body.append("{\"token\":");
+  appendJsonString(body, token_);
+  body.append(",\"type\":\"traces\",\"spans\":[");
+  body.append(items);
+  body.push_back(']');
+  if (dropped > 0)
+  {
+    body.append(",\"dropped_spans\":");
+    appendJsonValue(body, AttributeValue(dropped));
+  }
+  body.push_back('}');
+  queuePayload(std::move(payload));
+}
+
+void Exporter::replayCrashLog()
+{
+  // Lines cut short by the crash fail to parse and are skipped.
+  nlohmann::json logsArray = nlohmann::json::array();
+  for (auto &line : crashLog_->takeReplay())
+  {
+    nlohmann::json record = nlohmann::json::parse(line, nullptr, false);
+    if (record.is_object())
+    {
+      logsArray.push_back(std::move(record));
+    }
+  }
+  if (logsArray.empty())
+  {
+    return;
+  }
+
+  nlohmann::json jsonPayload;
+  jsonPayload["token"] = token_;
+  jsonPayload["type"] = "logs";
+  jsonPayload["logs"] = std::move(logsArray);
+
+  // Queued ahead of everything else; these records were never counted as
+  // enqueued, so they do not take part in flush accounting.
+  payloadQueue_.push_back(Payload{jsonPayload.dump(), 0});
+}
+
+void Exporter::encodeCrashLine(std::string &out, const LogMessage &msg)
+{
+  encodeRecord(out, msg, false);
+  size_t limit = CrashLog::kSlotSize - 1;
+  if (out.size() <= limit)
+  {
+    return;
+  }
+
+  // Too long for a slot. Cut the body, and drop the attributes if they alone
+  // do not fit, so that the line is still a record that replays.
+  LogMessage cut;
+  cut.timestamp = msg.timestamp;
+  cut.level = msg.level;
+  cut.attributes = msg.attributes;
+  cut.attributes.emplace_back(Key("crash_log.truncated"), true);
+  cut.bound = msg.bound;
+  cut.callsite = msg.callsite;
+  cut.exception = msg.exception;
+  out.clear();
+  encodeRecord(out, cut, false);
+  if (out.size() + kMinCrashBody > limit)
+  {
+    cut.attributes.clear();
+    cut.attributes.emplace_back(Key("crash_log.truncated"), true);
+    cut.bound.reset();
+    cut.callsite = nullptr;
+    cut.exception.reset();
+    out.clear();
+    encodeRecord(out, cut, false);
+  }
+
+  // Escaping can only make the body longer, so each pass shortens it by at
+  // least the excess.
+  size_t budget = limit > out.size() ? limit - out.size() : 0;
+  size_t length = std::min(msg.body.size(), budget);
+  std::string encodedBody;
+  while (true)
+  {
+    encodedBody.clear();
+    appendJsonString(encodedBody, std::string_view(msg.body).substr(0, length));
+    // The empty body already counts for two quotes.
+    if (encodedBody.size() - 2 <= budget || length == 0)
+    {
+      break;
+    }
+    length -= std::min(length, encodedBody.size() - 2 - budget);
+  }
+  cut.body.assign(msg.body, 0, length);
+  out.clear();
+  encodeRecord(out, cut, false);
+}
+
+void Exporter::encodeRecord(std::string &out, const LogMessage &msg, bool withException)
+{
+  out.append("{\"timestamp\":\"");
+  appendTimestamp(out, msg.timestamp);
+  out.push_back('"');
+  out.append(",\"body\":");
+  appendJsonString(out, msg.body);
+  out.append(",\"level\":");
+  appendJsonString(out, logLevelToString(msg.level));
+  out.append(",\"attributes\":{");
+
+  // Attributes that a later one with the same key overrides are skipped.
+  auto overridden = [&](size_t from, uint64_t hash, std::string_view key)
+  {
+    for (size_t j = from; j < msg.attributes.size(); ++j)
+    {
+      if (msg.attributes[j].hash() == hash && msg.attributes[j].key() == key)
+        return true;
+    }
+    return false;
+  };
+
+  bool first = true;
+  auto appendEncoded = [&](const BoundAttributes &attributes)
+  {
+    for (auto &entry : attributes.entries)
+    {
+      if (overridden(0, entry.hash, entry.key))
+      {
+        continue;
+      }
+      if (!first)
+      {
+        out.push_back(',');
+      }
+      out.append(entry.encoded);
+      first = false;
+    }
+  };
+  if (msg.callsite)
+  {
+    appendEncoded(msg.callsite->attributes());
+  }
+  if (msg.bound)
+  {
+    appendEncoded(*msg.bound);
+  }
+  for (size_t i = 0; i < msg.attributes.size(); ++i)
+  {
+    const KeyValue &attr = msg.attributes[i];
+    if (overridden(i + 1, attr.hash(), attr.key()))
+    {
+      continue;
+    }
+    if (!first)
+    {
+      out.push_back(',');
+    }
+    if (attr.plain())
+    {
+      out.push_back('"');
+      out.append(attr.key());
+      out.append("\":");
+      appendJsonValue(out, attr.value);
+    }
+    else
+    {
+      appendJsonMember(out, attr.key(), attr.value);
+    }
+    first = false;
+  }
+  if (withException && msg.exception)
+  {
+    appendException(out, *msg.exception, first);
+  }
+  out.append("}}");
+}
+
+void Exporter::prepareFork()
+{
+  loopsMutex_.lock();
+  queueMutex_.lock();
+  payloadMutex_.lock();
+  progressMutex_.lock();
+  metrics_.lockForFork();
+  tracer_->lockForFork();
+}
+
+void Exporter::resumeInParent()
+{
+  tracer_->unlockForFork();
+  metrics_.unlockForFork();
+  progressMutex_.unlock();
+  payloadMutex_.unlock();
+  queueMutex_.unlock();
+  loopsMutex_.unlock();
+}
+
+void Exporter::restartInChild()
+{
+  // Only the forking thread exists in the child. The std::thread handles
+  // refer to threads of the parent and can be neither joined nor detached,
+  // so they are overwritten without running their destructors. Condition
+  // variables may still record the parent's waiters and are rebuilt too.
+  new (&workerThread_) std::thread();
+  new (&senderThread_) std::thread();
+  new (&condition_) std::condition_variable();
+  new (&payloadReady_) std::condition_variable();
+  new (&payloadSpace_) std::condition_variable();
+  new (&progress_) std::condition_variable();
+  new (&loopsDone_) std::condition_variable();
+
+  // Queued records belong to the parent, which still delivers them.
+  std::queue<Pending>().swap(logQueue_);
+  payloadQueue_.clear();
+  enqueuedCount_ = 0;
+  settledCount_ = 0;
+  failedCount_ = 0;
+  flushRequested_ = false;
+  periodicChanged_ = false;
+  encoderDone_ = false;
+  if (crashLog_)
+  {
+    crashLog_->reset();
+  }
+  if (dedup_)
+  {
+    dedup_->clear();
+  }
+  metrics_.resetInChild();
+  tracer_->resetInChild();
+
+  runningLoops_ = started_ && !stopWorker_ ? 2 : 0;
+  // The parent's loops may have held it shared.
+  new (&lifetime_) std::shared_ptr<Lifetime>(std::make_shared<Lifetime>());
+  prewarmRequested_ = false;
+
+  progressMutex_.unlock();
+  payloadMutex_.unlock();
+  queueMutex_.unlock();
+  loopsMutex_.unlock();
+
+  if (stopWorker_)
+  {
+    return;
+  }
+  sink_->resetAfterFork();
+  if (started_)
+  {
+    startThreads();
+  }
+}
+
+void Exporter::registerForFork(Exporter *exporter)
+{
+  std::call_once(forkHandlersOnce, []()
+                 { pthread_atfork(&Exporter::onForkPrepare, &Exporter::onForkParent, &Exporter::onForkChild); });
+
+  std::lock_guard<std::mutex> lock(forkRegistryMutex);
+  forkRegistry.push_back(exporter);
+}
+
+void Exporter::unregisterForFork(Exporter *exporter)
+{
+  std::lock_guard<std::mutex> lock(forkRegistryMutex);
+  forkRegistry.erase(std::remove(forkRegistry.begin(), forkRegistry.end(), exporter), forkRegistry.end());
+}
+
+void Exporter::onForkPrepare()
+{
+  forkRegistryMutex.lock();
+  for (Exporter *exporter : forkRegistry)
+  {
+    exporter->prepareFork();
+  }
+  TransportContext::lockForFork();
+  lockExceptionCacheForFork();
+}
+
+void Exporter::onForkParent()
+{
+  unlockExceptionCacheForFork();
+  TransportContext::unlockForFork();
+  for (Exporter *exporter : forkRegistry)
+  {
+    exporter->resumeInParent();
+  }
+  forkRegistryMutex.unlock();
+}
+
+void Exporter::onForkChild()
+{
+  resetExceptionCacheInChild();
+  TransportContext::forgetInChild();
+  for (Exporter *exporter : forkRegistry)
+  {
+    exporter->restartInChild();
+  }
+  forkRegistryMutex.unlock();
+}
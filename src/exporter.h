@@ -0,0 +1,285 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <queue>
+#include <deque>
+#include <chrono>
+#include <memory>
+#include <functional>
+
+#include "log_message.h"
+#include "sink.h"
+#include "crash_log.h"
+#include "sampler.h"
+#include "metrics.h"
+
+class Deduplicator;
+class Tracer;
+struct SpanRing;
+
+struct ExporterOptions
+{
+  std::string token;
+  std::shared_ptr<Sink> sink;
+  size_t maxBatchSize = 100;
+  std::chrono::milliseconds batchInterval = std::chrono::milliseconds(100);
+  // When set, the most recent undelivered records are written here if the
+  // process dies from a fatal signal, and uploaded by the next Exporter
+  // created with the same path.
+  std::string crashLogPath;
+  size_t crashLogCapacity = 512;
+
+  // With adaptive batching the batch size and interval are retuned as load
+  // changes, aiming to deliver every record within targetLatency while
+  // sending as few requests as possible. maxBatchSize becomes the upper
+  // bound for the batch size and batchInterval the starting interval.
+  bool adaptiveBatching = false;
+  size_t minBatchSize = 1;
+  std::chrono::milliseconds minBatchInterval = std::chrono::milliseconds(10);
+  std::chrono::milliseconds maxBatchInterval = std::chrono::milliseconds(5000);
+  std::chrono::milliseconds targetLatency = std::chrono::milliseconds(1000);
+
+  // Source of time for batch deadlines. Defaults to steady_clock::now; tests
+  // can substitute a manually advanced clock.
+  std::function<std::chrono::steady_clock::time_point()> clock;
+
+  // Placement of the batcher and sender threads. Threads are named
+  // "<workerName>-batch" and "<workerName>-send" (truncated to 15
+  // characters). An empty workerCpus leaves affinity alone, workerNice 0
+  // leaves the nice value alone and a negative workerSchedPolicy leaves the
+  // scheduling policy alone. Only supported on Linux.
+  std::string workerName = "vigilant";
+  std::vector<int> workerCpus;
+  int workerNice = 0;
+  int workerSchedPolicy = -1;
+  int workerSchedPriority = 0;
+
+  // When set, the batcher and sender loops are handed to this function
+  // instead of running on threads the Exporter spawns, and the placement
+  // settings above are ignored. Each task runs until shutdown, so the
+  // executor must give each one a thread of its own.
+  std::function<void(std::function<void()>)> executor;
+
+  // Sampling applied by every Logger attached to this Exporter. The default
+  // keeps everything.
+  SamplingOptions sampling;
+
+  // When positive, identical records arriving within dedupWindow of the
+  // first one are collapsed into a single summary record carrying
+  // repeat_count, first_seen and last_seen. At most dedupCapacity distinct
+  // records are tracked at a time.
+  std::chrono::milliseconds dedupWindow = std::chrono::milliseconds(0);
+  size_t dedupCapacity = 1024;
+
+  // How often metrics recorded through counter(), gauge() and histogram()
+  // are sent.
+  std::chrono::milliseconds metricsInterval = std::chrono::seconds(10);
+
+  // How often finished spans are sent as a "traces" payload.
+  std::chrono::milliseconds traceInterval = std::chrono::seconds(1);
+
+  // How long the destructor waits for queued records, as
+  // shutdown(destroyTimeout) would. A sink that is still inside send() once
+  // cancel() has had a moment to work is abandoned, along with the payload
+  // it was sending, rather than holding up the destructor.
+  std::chrono::milliseconds destroyTimeout = std::chrono::seconds(5);
+};
+
+// Batches records from any number of Loggers and delivers them to one Sink.
+// Nothing is started until the first record arrives or prewarm() is called.
+// An encoder thread groups queued records into batches and serializes them;
+// a sender thread uploads the finished payloads. Loggers attached to the same
+// Exporter share both threads and the connection, and their records are
+// merged into the same batches.
+//
+// Exporters survive fork(): the child process discards whatever the parent
+// still had queued, reconnects its sink and restarts both threads.
+class Exporter
+{
+public:
+  explicit Exporter(ExporterOptions options);
+
+  ~Exporter();
+
+  Exporter(const Exporter &) = delete;
+  Exporter &operator=(const Exporter &) = delete;
+
+  void enqueue(LogMessage message);
+
+  // Whether a record at this level, from this call site if known, should be
+  // logged at all; see Sampler.
+  bool admit(LogLevel level, Callsite *site) { return sampler_.admit(level, site); }
+
+  // Metric instruments whose values are sent every metrics interval as a
+  // "metrics" payload; see metrics.h. Creating one starts the pipeline.
+  Counter counter(const std::string &name, const std::vector<Attribute> &attrs = {});
+  Gauge gauge(const std::string &name, const std::vector<Attribute> &attrs = {});
+  Histogram histogram(const std::string &name, const std::vector<double> &bounds, const std::vector<Attribute> &attrs = {});
+
+  // Starts the pipeline ahead of the first record and lets the sink set up
+  // its connection in the background.
+  void prewarm();
+
+  // Sends everything enqueued before the call and waits until it has been
+  // handed to the sink or the timeout expires. Returns the number of those
+  // messages that were not delivered.
+  size_t flush(std::chrono::milliseconds timeout);
+
+  // Stops accepting messages and drains the queue. Whatever is still pending
+  // when the timeout expires is dropped. With a finite timeout, a sink that
+  // does not return from send() shortly after cancel() is abandoned. Returns
+  // the number of messages that were not delivered.
+  size_t shutdown(std::chrono::milliseconds timeout = std::chrono::milliseconds::max());
+
+private:
+  friend class Logger;
+
+  std::string token_;
+  std::shared_ptr<Sink> sink_;
+  size_t maxBatchSize_;
+  std::chrono::milliseconds batchInterval_;
+
+  // Current batching limits. Fixed unless adaptive batching is enabled, in
+  // which case the batcher retunes them from the observed arrival rate,
+  // encode time and upload time.
+  bool adaptiveBatching_;
+  size_t minBatchSize_;
+  std::chrono::milliseconds minBatchInterval_;
+  std::chrono::milliseconds maxBatchInterval_;
+  std::chrono::milliseconds targetLatency_;
+  size_t batchSizeLimit_;
+  std::chrono::milliseconds currentInterval_;
+  double arrivalRate_;
+  double encodeNanos_;
+  std::atomic<int64_t> uploadNanos_;
+  std::function<std::chrono::steady_clock::time_point()> clock_;
+  std::string workerName_;
+  std::vector<int> workerCpus_;
+  int workerNice_;
+  int workerSchedPolicy_;
+  int workerSchedPriority_;
+  std::function<void(std::function<void()>)> executor_;
+  std::chrono::milliseconds destroyTimeout_;
+
+  std::atomic<bool> stopWorker_;
+  std::atomic<bool> abandon_;
+  bool flushRequested_;
+  // Set when the first instrument or span appears, so that the batcher picks
+  // up the new schedule.
+  bool periodicChanged_;
+  bool started_;
+  std::atomic<bool> prewarmRequested_;
+  std::thread workerThread_;
+  std::thread senderThread_;
+  // Loops still running, whether on our threads or the executor's.
+  std::mutex loopsMutex_;
+  std::condition_variable loopsDone_;
+  int runningLoops_;
+
+  // Lets shutdown() walk away from a sink stuck in send(). The loops hold
+  // mutex shared while they touch the Exporter; the sender lets go of it
+  // around sink calls. Holding it exclusively therefore means every loop
+  // still running is inside the sink, and setting detached tells them to
+  // return without touching the Exporter again. Shared with the loops so
+  // that it outlives the Exporter.
+  struct Lifetime
+  {
+    std::shared_mutex mutex;
+    bool detached = false;
+  };
+  using LoopLock = std::shared_lock<std::shared_mutex>;
+  std::shared_ptr<Lifetime> lifetime_;
+  std::mutex queueMutex_;
+  std::condition_variable condition_;
+  struct Pending
+  {
+    LogMessage message;
+    std::chrono::steady_clock::time_point enqueuedAt;
+  };
+  std::queue<Pending> logQueue_;
+  uint64_t enqueuedCount_;
+
+  // Every enqueued message is eventually settled: delivered, rejected by the
+  // sink, or dropped at shutdown. Delivery is FIFO, so settledCount_ is also
+  // the sequence number of the last settled message.
+  std::atomic<uint64_t> settledCount_;
+  std::atomic<uint64_t> failedCount_;
+  std::mutex progressMutex_;
+  std::condition_variable progress_;
+  std::unique_ptr<CrashLog> crashLog_;
+  Sampler sampler_;
+  std::unique_ptr<Deduplicator> dedup_;
+  MetricRegistry metrics_;
+  std::chrono::milliseconds metricsInterval_;
+  std::unique_ptr<Tracer> tracer_;
+  std::chrono::milliseconds traceInterval_;
+
+  struct Payload
+  {
+    std::string body;
+    size_t messages;
+  };
+
+  // Encoded payloads handed from the batcher to the sender. Holding at most
+  // kPayloadSlots lets one batch be encoded while the previous one uploads.
+  static constexpr size_t kPayloadSlots = 2;
+  std::mutex payloadMutex_;
+  std::condition_variable payloadReady_;
+  std::condition_variable payloadSpace_;
+  std::deque<Payload> payloadQueue_;
+  bool encoderDone_;
+
+  std::chrono::steady_clock::time_point now() const;
+  // Marks the pipeline started, with queueMutex_ held. Returns whether the
+  // caller must call startThreads() once it has released the lock: the
+  // executor is user code, and fork() takes loopsMutex_ before queueMutex_.
+  bool startLocked();
+  void startThreads();
+  // Waits up to timeout for the loops to finish and joins their threads.
+  // Returns whether they finished.
+  bool joinThreads(std::chrono::milliseconds timeout);
+  void detachLoops();
+  void abandon();
+  void runLoop(void (Exporter::*loop)(LoopLock &));
+  void applyThreadPlacement(const char *role);
+  void runBatcher(LoopLock &);
+  void runSender(LoopLock &held);
+  void sendBatch(std::vector<LogMessage> &batch, size_t messages);
+  void queuePayload(Payload payload);
+  void tuneBatching(size_t arrived, std::chrono::steady_clock::duration elapsed);
+  void replayCrashLog();
+  void reportSuppressed();
+  void sendMetrics();
+  void sendSpans();
+  // For Logger::startSpan: the calling thread's span ring, and the interned
+  // service name its spans refer to.
+  std::shared_ptr<SpanRing> spanRing();
+  const std::string *spanService(const std::string &name);
+  void startPeriodic();
+  void settle(size_t messages, bool delivered);
+  bool waitForSettled(uint64_t target, std::chrono::milliseconds timeout);
+  // Exceptions are only demangled and resolved on the batcher; crash log
+  // lines, which are encoded on the logging thread, leave them out.
+  static void encodeRecord(std::string &out, const LogMessage &msg, bool withException = true);
+  // Encodes msg for the crash log, cutting the body so the line fits in a
+  // slot and still parses.
+  static void encodeCrashLine(std::string &out, const LogMessage &msg);
+
+  void prepareFork();
+  void resumeInParent();
+  void restartInChild();
+  static void registerForFork(Exporter *exporter);
+  static void unregisterForFork(Exporter *exporter);
+  static void onForkPrepare();
+  static void onForkParent();
+  static void onForkChild();
+};
+
+#endif // EXPORTER_H
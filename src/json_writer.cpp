@@ -0,0 +1,206 @@
+#include <string>
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <ctime>
+#include <charconv>
+
+#include "json_writer.h"
+
+namespace
+{
+  const char kHexDigits[] = "0123456789abcdef";
+
+  // Length of the well-formed UTF-8 sequence starting at s[i], or 0.
+  size_t utf8SequenceLength(std::string_view s, size_t i)
+  {
+    auto byte = [&](size_t at)
+    { return static_cast<unsigned char>(s[at]); };
+    auto continuation = [&](size_t at)
+    { return at < s.size() && (byte(at) & 0xC0) == 0x80; };
+
+    unsigned char lead = byte(i);
+    if (lead >= 0xC2 && lead <= 0xDF)
+    {
+      return continuation(i + 1) ? 2 : 0;
+    }
+    if (lead >= 0xE0 && lead <= 0xEF)
+    {
+      if (!continuation(i + 1) || !continuation(i + 2))
+        return 0;
+      unsigned char second = byte(i + 1);
+      // Reject overlong forms and UTF-16 surrogates.
+      if ((lead == 0xE0 && second < 0xA0) || (lead == 0xED && second > 0x9F))
+        return 0;
+      return 3;
+    }
+    if (lead >= 0xF0 && lead <= 0xF4)
+    {
+      if (!continuation(i + 1) || !continuation(i + 2) || !continuation(i + 3))
+        return 0;
+      unsigned char second = byte(i + 1);
+      if ((lead == 0xF0 && second < 0x90) || (lead == 0xF4 && second > 0x8F))
+        return 0;
+      return 4;
+    }
+    return 0;
+  }
+}
+
+void appendJsonString(std::string &out, std::string_view s)
+{
+  out.push_back('"');
+  size_t i = 0;
+  while (i < s.size())
+  {
+    // Copy runs that need no escaping in one go.
+    size_t run = i;
+    while (run < s.size())
+    {
+      unsigned char c = static_cast<unsigned char>(s[run]);
+      if (c < 0x20 || c == '"' || c == '\\' || c >= 0x80)
+        break;
+      ++run;
+    }
+    out.append(s.data() + i, run - i);
+    i = run;
+    if (i == s.size())
+      break;
+
+    unsigned char c = static_cast<unsigned char>(s[i]);
+    if (c >= 0x80)
+    {
+      size_t length = utf8SequenceLength(s, i);
+      if (length == 0)
+      {
+        out.append("\xEF\xBF\xBD");
+        ++i;
+      }
+      else
+      {
+        out.append(s.data() + i, length);
+        i += length;
+      }
+      continue;
+    }
+
+    switch (c)
+    {
+    case '"':
+      out.append("\\\"");
+      break;
+    case '\\':
+      out.append("\\\\");
+      break;
+    case '\b':
+      out.append("\\b");
+      break;
+    case '\f':
+      out.append("\\f");
+      break;
+    case '\n':
+      out.append("\\n");
+      break;
+    case '\r':
+      out.append("\\r");
+      break;
+    case '\t':
+      out.append("\\t");
+      break;
+    default:
+      out.append("\\u00");
+      out.push_back(kHexDigits[c >> 4]);
+      out.push_back(kHexDigits[c & 0xF]);
+      break;
+    }
+    ++i;
+  }
+  out.push_back('"');
+}
+
+void appendJsonValue(std::string &out, const AttributeValue &value)
+{
+  char buffer[32];
+  switch (value.type())
+  {
+  case AttributeValue::Type::String:
+    appendJsonString(out, value.asString());
+    return;
+  case AttributeValue::Type::Int:
+    out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value.asInt()).ptr);
+    return;
+  case AttributeValue::Type::Uint:
+    out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value.asUint()).ptr);
+    return;
+  case AttributeValue::Type::Double:
+    if (!std::isfinite(value.asDouble()))
+    {
+      out.append("null");
+      return;
+    }
+    out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value.asDouble()).ptr);
+    return;
+  case AttributeValue::Type::Bool:
+    out.append(value.asBool() ? "true" : "false");
+    return;
+  case AttributeValue::Type::Timestamp:
+    out.push_back('"');
+    appendTimestamp(out, value.asTimestamp());
+    out.push_back('"');
+    return;
+  case AttributeValue::Type::Null:
+    out.append("null");
+    return;
+  }
+}
+
+void appendJsonMember(std::string &out, std::string_view key, const AttributeValue &value)
+{
+  appendJsonString(out, key);
+  out.push_back(':');
+  appendJsonValue(out, value);
+}
+
+void appendTimestamp(std::string &out, std::chrono::system_clock::time_point tp)
+{
+  auto sinceEpoch = std::chrono::duration_cast<std::chrono::milliseconds>(tp.time_since_epoch());
+  auto seconds = std::chrono::duration_cast<std::chrono::seconds>(sinceEpoch);
+  auto millis = sinceEpoch - seconds;
+  if (millis.count() < 0)
+  {
+    seconds -= std::chrono::seconds(1);
+    millis += std::chrono::seconds(1);
+  }
+
+  std::time_t tt = static_cast<std::time_t>(seconds.count());
+  std::tm tm{};
+  gmtime_r(&tt, &tm);
+
+  char buffer[32];
+  char *p = buffer;
+  auto put = [&](int value, int digits)
+  {
+    for (int i = digits - 1; i >= 0; --i)
+    {
+      p[i] = static_cast<char>('0' + value % 10);
+      value /= 10;
+    }
+    p += digits;
+  };
+  put(tm.tm_year + 1900, 4);
+  *p++ = '-';
+  put(tm.tm_mon + 1, 2);
+  *p++ = '-';
+  put(tm.tm_mday, 2);
+  *p++ = 'T';
+  put(tm.tm_hour, 2);
+  *p++ = ':';
+  put(tm.tm_min, 2);
+  *p++ = ':';
+  put(tm.tm_sec, 2);
+  *p++ = '.';
+  put(static_cast<int>(millis.count()), 3);
+  *p++ = 'Z';
+  out.append(buffer, p);
+}
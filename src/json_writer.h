@@ -0,0 +1,28 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <string>
+#include <string_view>
+#include <chrono>
+
+#include "log_message.h"
+
+// Minimal JSON output used by the encoder. Records are written straight into
+// the payload buffer so that pre-encoded fragments, such as the attributes
+// bound to a child Logger, can be copied in without being parsed again.
+
+// Appends s as a quoted JSON string. Invalid UTF-8 is replaced with U+FFFD.
+void appendJsonString(std::string &out, std::string_view s);
+
+// Appends the value as a JSON string, number or boolean. NaN and infinite
+// doubles, which JSON cannot represent, are written as null.
+void appendJsonValue(std::string &out, const AttributeValue &value);
+
+// Appends "key":value.
+void appendJsonMember(std::string &out, std::string_view key, const AttributeValue &value);
+
+// Appends tp as an unquoted ISO-8601 UTC timestamp with millisecond
+// precision, e.g. 2024-05-01T12:00:00.000Z.
+void appendTimestamp(std::string &out, std::chrono::system_clock::time_point tp);
+
+#endif // JSON_WRITER_H
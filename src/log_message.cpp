@@ -0,0 +1,32 @@
+#include <string>
+#include <ostream>
+
+#include "log_message.h"
+#include "json_writer.h"
+
+std::string AttributeValue::toString() const
+{
+  if (type_ == Type::String)
+  {
+    return string_;
+  }
+  std::string text;
+  if (type_ == Type::Timestamp)
+  {
+    appendTimestamp(text, asTimestamp());
+  }
+  else
+  {
+    appendJsonValue(text, *this);
+  }
+  return text;
+}
+
+std::ostream &operator<<(std::ostream &os, const AttributeValue &value)
+{
+  if (value.type() == AttributeValue::Type::String)
+  {
+    return os << value.asString();
+  }
+  return os << value.toString();
+}
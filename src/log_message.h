@@ -0,0 +1,406 @@
+#ifndef LOG_MESSAGE_H
+#define LOG_MESSAGE_H
+
+#include <string>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <ostream>
+#include <type_traits>
+#include <string_view>
+#include <utility>
+#include <ctime>
+#include <new>
+#include <cstddef>
+
+enum class LogLevel
+{
+  Debug,
+  Info,
+  Warn,
+  Error
+};
+
+// The value of an attribute. Numbers and booleans are kept as such and
+// written to the payload as JSON numbers and booleans, so they can be
+// aggregated by the backend and need no string conversion at the call site.
+// Timestamps are written as ISO-8601 strings in UTC, a char as a
+// one-character string and a null const char * as null.
+//
+// A tag and a union of the alternatives, strings included, so a value is no
+// larger than a std::string and a tag.
+class AttributeValue
+{
+public:
+  enum class Type
+  {
+    String,
+    Int,
+    Uint,
+    Double,
+    Bool,
+    Timestamp,
+    Null
+  };
+
+  AttributeValue() : type_(Type::String), string_() {}
+  AttributeValue(const char *value) : type_(value ? Type::String : Type::Null)
+  {
+    if (value)
+    {
+      new (&string_) std::string(value);
+    }
+  }
+  AttributeValue(const std::string &value) : type_(Type::String), string_(value) {}
+  AttributeValue(std::string &&value) : type_(Type::String), string_(std::move(value)) {}
+  AttributeValue(std::string_view value) : type_(Type::String), string_(value) {}
+  AttributeValue(char value) : type_(Type::String), string_(1, value) {}
+  AttributeValue(std::nullptr_t) : type_(Type::Null) {}
+  AttributeValue(bool value) : type_(Type::Bool), bool_(value) {}
+  AttributeValue(double value) : type_(Type::Double), double_(value) {}
+  AttributeValue(float value) : type_(Type::Double), double_(value) {}
+  AttributeValue(std::chrono::system_clock::time_point value)
+      : type_(Type::Timestamp),
+        int_(std::chrono::duration_cast<std::chrono::nanoseconds>(value.time_since_epoch()).count()) {}
+
+  template <typename T,
+            typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value &&
+                                        !std::is_same<T, char>::value,
+                                    int>::type = 0>
+  AttributeValue(T value)
+  {
+    if (std::is_signed<T>::value)
+    {
+      type_ = Type::Int;
+      int_ = static_cast<int64_t>(value);
+    }
+    else
+    {
+      type_ = Type::Uint;
+      uint_ = static_cast<uint64_t>(value);
+    }
+  }
+
+  AttributeValue(const AttributeValue &other) : type_(Type::Null) { assign(other); }
+  AttributeValue(AttributeValue &&other) noexcept : type_(Type::Null) { assign(std::move(other)); }
+  AttributeValue &operator=(const AttributeValue &other)
+  {
+    if (this != &other)
+    {
+      AttributeValue copy(other);
+      reset();
+      assign(std::move(copy));
+    }
+    return *this;
+  }
+  AttributeValue &operator=(AttributeValue &&other) noexcept
+  {
+    if (this != &other)
+    {
+      reset();
+      assign(std::move(other));
+    }
+    return *this;
+  }
+  ~AttributeValue() { reset(); }
+
+  Type type() const { return type_; }
+  // Empty unless type() is String.
+  const std::string &asString() const
+  {
+    static const std::string empty;
+    return type_ == Type::String ? string_ : empty;
+  }
+  int64_t asInt() const { return int_; }
+  uint64_t asUint() const { return uint_; }
+  double asDouble() const { return double_; }
+  bool asBool() const { return bool_; }
+  std::chrono::system_clock::time_point asTimestamp() const
+  {
+    return std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(int_)));
+  }
+
+  // The value as text, as written by the console passthrough.
+  std::string toString() const;
+
+private:
+  Type type_;
+  union
+  {
+    int64_t int_;
+    uint64_t uint_;
+    double double_;
+    bool bool_;
+    std::string string_;
+  };
+
+  // Leaves the value Null.
+  void reset()
+  {
+    if (type_ == Type::String)
+    {
+      string_.~basic_string();
+    }
+    type_ = Type::Null;
+  }
+
+  // Requires a Null value.
+  template <typename Other>
+  void assign(Other &&other)
+  {
+    switch (other.type_)
+    {
+    case Type::String:
+      new (&string_) std::string(std::forward<Other>(other).string_);
+      break;
+    case Type::Int:
+    case Type::Timestamp:
+      int_ = other.int_;
+      break;
+    case Type::Uint:
+      uint_ = other.uint_;
+      break;
+    case Type::Double:
+      double_ = other.double_;
+      break;
+    case Type::Bool:
+      bool_ = other.bool_;
+      break;
+    case Type::Null:
+      break;
+    }
+    type_ = other.type_;
+  }
+};
+
+std::ostream &operator<<(std::ostream &os, const AttributeValue &value);
+
+struct Attribute
+{
+  std::string key;
+  AttributeValue value;
+};
+
+// FNV-1a, used to compare attribute keys quickly.
+constexpr uint64_t hashKey(const char *data, size_t size)
+{
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; ++i)
+  {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// An attribute key made from a string literal. Its hash, and whether it can
+// be written to JSON without escaping, are worked out when the Key is
+// constructed, which happens at compile time for a constexpr Key and is
+// usually folded away by the optimizer at call sites:
+//
+//   constexpr Key kTenant("tenant");
+//   logger.info("request", kv(kTenant, tenant), kv("status", 200));
+//
+// The Key only points at the literal, which must outlive every record, so
+// it can't be made from a writable char buffer; pass those to kv(), which
+// copies them.
+class Key
+{
+public:
+  template <size_t N>
+  constexpr Key(const char (&literal)[N])
+      : data_(literal),
+        size_(length(literal, N - 1)),
+        hash_(hashKey(literal, length(literal, N - 1))),
+        plain_(isPlain(literal, length(literal, N - 1)))
+  {
+  }
+  template <size_t N>
+  Key(char (&buffer)[N]) = delete;
+
+  constexpr const char *data() const { return data_; }
+  constexpr size_t size() const { return size_; }
+  constexpr uint64_t hash() const { return hash_; }
+  constexpr bool plain() const { return plain_; }
+
+private:
+  const char *data_;
+  size_t size_;
+  uint64_t hash_;
+  bool plain_;
+
+  // Up to the first NUL, for a const array larger than its string.
+  static constexpr size_t length(const char *data, size_t limit)
+  {
+    size_t size = 0;
+    while (size < limit && data[size] != '\0')
+      ++size;
+    return size;
+  }
+
+  static constexpr bool isPlain(const char *data, size_t size)
+  {
+    for (size_t i = 0; i < size; ++i)
+    {
+      unsigned char c = static_cast<unsigned char>(data[i]);
+      if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\')
+        return false;
+    }
+    return true;
+  }
+};
+
+// One attribute of a record. The key either points at a Key's literal or,
+// for keys only known at run time, is owned by the KeyValue.
+class KeyValue
+{
+public:
+  KeyValue(Key key, AttributeValue value)
+      : value(std::move(value)), static_(key.data()), size_(key.size()), hash_(key.hash()), plain_(key.plain())
+  {
+  }
+
+  KeyValue(std::string key, AttributeValue value)
+      : value(std::move(value)), static_(nullptr), size_(key.size()), hash_(hashKey(key.data(), key.size())), plain_(false), owned_(std::move(key))
+  {
+  }
+
+  KeyValue(const Attribute &attr) : KeyValue(attr.key, attr.value) {}
+  KeyValue(Attribute &&attr) : KeyValue(std::move(attr.key), std::move(attr.value)) {}
+
+  std::string_view key() const { return static_ ? std::string_view(static_, size_) : std::string_view(owned_); }
+  uint64_t hash() const { return hash_; }
+  // True when the key can be written without JSON escaping.
+  bool plain() const { return plain_; }
+
+  AttributeValue value;
+
+private:
+  const char *static_;
+  size_t size_;
+  uint64_t hash_;
+  bool plain_;
+  std::string owned_;
+};
+
+template <typename T>
+KeyValue kv(Key key, T &&value)
+{
+  return KeyValue(key, AttributeValue(std::forward<T>(value)));
+}
+
+template <size_t N, typename T>
+KeyValue kv(const char (&key)[N], T &&value)
+{
+  return KeyValue(Key(key), AttributeValue(std::forward<T>(value)));
+}
+
+// Keys built at run time are copied into the KeyValue.
+template <size_t N, typename T>
+KeyValue kv(char (&key)[N], T &&value)
+{
+  size_t size = 0;
+  while (size < N && key[size] != '\0')
+    ++size;
+  return KeyValue(std::string(key, size), AttributeValue(std::forward<T>(value)));
+}
+
+template <typename T>
+KeyValue kv(std::string key, T &&value)
+{
+  return KeyValue(std::move(key), AttributeValue(std::forward<T>(value)));
+}
+
+// Enables the variadic overloads taking one or more kv() pairs or
+// Attributes.
+template <typename... Fields>
+using EnableIfFields = typename std::enable_if<
+    (sizeof...(Fields) > 0) &&
+    (... && (std::is_same<typename std::decay<Fields>::type, KeyValue>::value ||
+             std::is_same<typename std::decay<Fields>::type, Attribute>::value))>::type;
+
+// Attributes bound to a child Logger by Logger::with(). Each one is encoded
+// as a JSON member when the child is created, and the encoder copies those
+// bytes into every record the child logs.
+struct BoundAttributes
+{
+  struct Entry
+  {
+    std::string key;
+    uint64_t hash;
+    AttributeValue value;
+    std::string encoded;
+  };
+  std::vector<Entry> entries;
+};
+
+class Callsite;
+
+// The exception attached to a record, as captured by Logger. Type names are
+// kept mangled and stack frames as raw return addresses; both are resolved
+// on the batcher thread when the record is encoded.
+struct ExceptionInfo
+{
+  struct Cause
+  {
+    // typeid name, or nullptr for an exception not derived from
+    // std::exception.
+    const char *type;
+    std::string message;
+  };
+  // The exception itself, then each exception nested inside it.
+  std::vector<Cause> causes;
+  // Return addresses at the point the record was logged, innermost first.
+  std::vector<void *> frames;
+};
+
+struct LogMessage
+{
+  std::chrono::system_clock::time_point timestamp;
+  std::string body;
+  LogLevel level;
+  // In order of precedence, lowest first: when a key repeats, the last
+  // occurrence wins.
+  std::vector<KeyValue> attributes;
+  // Shared by every record from the same child Logger. Per-record
+  // attributes take precedence over bound ones with the same key.
+  std::shared_ptr<const BoundAttributes> bound;
+  // Set for records logged through the VIGILANT_* macros.
+  const Callsite *callsite = nullptr;
+  // Set for records logged with an exception.
+  std::shared_ptr<const ExceptionInfo> exception;
+};
+
+inline std::string logLevelToString(LogLevel level)
+{
+  switch (level)
+  {
+  case LogLevel::Debug:
+    return "DEBUG";
+  case LogLevel::Info:
+    return "INFO";
+  case LogLevel::Warn:
+    return "WARNING";
+  case LogLevel::Error:
+    return "ERROR";
+  }
+  return "UNKNOWN";
+}
+
+inline std::string timePointToString(const std::chrono::system_clock::time_point &tp)
+{
+  std::time_t tt = std::chrono::system_clock::to_time_t(tp);
+  std::tm tm{};
+#if defined(_WIN32)
+  localtime_s(&tm, &tt);
+#else
+  localtime_r(&tt, &tm);
+#endif
+  char buffer[32];
+  std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm);
+  return std::string(buffer);
+}
+
+#endif // LOG_MESSAGE_H
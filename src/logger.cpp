@@ -5,16 +5,20 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <deque>
 #include <chrono>
 #include <iostream>
 #include <sstream>
 #include <map>
 #include <ctime>
+#include <memory>
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
 #include <iomanip>
 
 #include "logger.h"
+#include "json_writer.h"
+#include "exception_capture.h"
 
 Logger::Logger(const std::string &name,
                const std::string &endpoint,
@@ -23,61 +27,164 @@ Logger::Logger(const std::string &name,
                bool insecure,
                bool noop,
                size_t maxBatchSize,
-               std::chrono::milliseconds batchInterval)
-    : serviceName_(name),
-      endpoint_(formatEndpoint(endpoint, insecure)),
-      token_(token),
-      passthrough_(passthrough),
-      noop_(noop),
-      maxBatchSize_(maxBatchSize),
-      batchInterval_(batchInterval),
-      stopWorker_(false)
+               std::chrono::milliseconds batchInterval,
+               std::shared_ptr<Sink> sink)
+    : core_()
 {
-  curl_global_init(CURL_GLOBAL_DEFAULT);
-  workerThread_ = std::thread(&Logger::runBatcher, this);
+  if (noop)
+  {
+    return;
+  }
+
+  ExporterOptions options;
+  options.token = token;
+  options.sink = sink ? std::move(sink)
+                      : std::make_shared<HttpSink>(formatEndpoint(endpoint, insecure),
+                                                   HttpTimeouts::forBatchInterval(batchInterval));
+  options.maxBatchSize = maxBatchSize;
+  options.batchInterval = batchInterval;
+  auto exporter = std::make_shared<Exporter>(std::move(options));
+  const std::string *spanService = exporter->spanService(name);
+  core_ = std::make_shared<const Core>(Core{name, passthrough, std::move(exporter), true, spanService});
+}
+
+Logger::Logger(const std::string &name,
+               std::shared_ptr<Exporter> exporter,
+               bool passthrough,
+               bool noop)
+    : Logger(name, std::move(exporter), passthrough, noop, false)
+{
+}
+
+Logger::Logger(const std::string &name,
+               std::shared_ptr<Exporter> exporter,
+               bool passthrough,
+               bool noop,
+               bool ownsExporter)
+    : core_()
+{
+  if (noop || !exporter)
+  {
+    return;
+  }
+  const std::string *spanService = exporter->spanService(name);
+  core_ = std::make_shared<const Core>(Core{name, passthrough, std::move(exporter), ownsExporter, spanService});
+}
+
+Logger Logger::with(const std::vector<Attribute> &attrs) const
+{
+  if (!core_ || attrs.empty())
+  {
+    return *this;
+  }
+
+  // Later bindings replace earlier ones with the same key.
+  auto bound = std::make_shared<BoundAttributes>();
+  if (bound_)
+  {
+    for (auto &entry : bound_->entries)
+    {
+      bool replaced = std::any_of(attrs.begin(), attrs.end(), [&](const Attribute &attr)
+                                  { return attr.key == entry.key; });
+      if (!replaced)
+      {
+        bound->entries.push_back(entry);
+      }
+    }
+  }
+  for (auto &attr : attrs)
+  {
+    auto existing = std::find_if(bound->entries.begin(), bound->entries.end(), [&](const BoundAttributes::Entry &entry)
+                                 { return entry.key == attr.key; });
+    std::string encoded;
+    appendJsonMember(encoded, attr.key, attr.value);
+    uint64_t hash = hashKey(attr.key.data(), attr.key.size());
+    if (existing != bound->entries.end())
+    {
+      existing->value = attr.value;
+      existing->encoded = std::move(encoded);
+    }
+    else
+    {
+      bound->entries.push_back(BoundAttributes::Entry{attr.key, hash, attr.value, std::move(encoded)});
+    }
+  }
+
+  Logger child(*this);
+  child.bound_ = std::move(bound);
+  return child;
 }
 
-Logger::~Logger()
+Counter Logger::counter(const std::string &name, const std::vector<Attribute> &attrs) const
 {
-  shutdown();
+  if (!core_)
+  {
+    return Counter();
+  }
+  return core_->exporter->counter(name, metricAttributes(attrs));
 }
 
-void Logger::debug(const std::string &message, const std::vector<Attribute> &attrs)
+Gauge Logger::gauge(const std::string &name, const std::vector<Attribute> &attrs) const
 {
-  logMessage(LogLevel::Debug, message, nullptr, attrs);
+  if (!core_)
+  {
+    return Gauge();
+  }
+  return core_->exporter->gauge(name, metricAttributes(attrs));
 }
 
-void Logger::info(const std::string &message, const std::vector<Attribute> &attrs)
+Histogram Logger::histogram(const std::string &name, const std::vector<double> &bounds, const std::vector<Attribute> &attrs) const
 {
-  logMessage(LogLevel::Info, message, nullptr, attrs);
+  if (!core_)
+  {
+    return Histogram();
+  }
+  return core_->exporter->histogram(name, bounds, metricAttributes(attrs));
 }
 
-void Logger::warn(const std::string &message, const std::vector<Attribute> &attrs)
+Span Logger::startSpan(std::string name, const std::vector<Attribute> &attrs) const
 {
-  logMessage(LogLevel::Warn, message, nullptr, attrs);
+  if (!core_)
+  {
+    return Span(nullptr, nullptr, std::move(name), attrs);
+  }
+  return Span(core_->exporter->spanRing(), core_->spanService, std::move(name), attrs);
 }
 
-void Logger::error(const std::string &message, const std::exception *err, const std::vector<Attribute> &attrs)
+std::vector<Attribute> Logger::metricAttributes(const std::vector<Attribute> &attrs) const
 {
-  logMessage(LogLevel::Error, message, err, attrs);
+  std::vector<Attribute> all;
+  all.reserve(attrs.size() + 1);
+  all.push_back(Attribute{"service.name", core_->serviceName});
+  all.insert(all.end(), attrs.begin(), attrs.end());
+  return all;
 }
 
-void Logger::shutdown()
+void Logger::prewarm()
 {
+  if (!core_ || !core_->exporter)
   {
-    std::lock_guard<std::mutex> lock(queueMutex_);
-    if (stopWorker_)
-    {
-      return;
-    }
-    stopWorker_ = true;
+    return;
   }
-  condition_.notify_all();
-  if (workerThread_.joinable())
+  core_->exporter->prewarm();
+}
+
+size_t Logger::flush(std::chrono::milliseconds timeout)
+{
+  if (!core_ || !core_->exporter)
   {
-    workerThread_.join();
+    return 0;
   }
-  curl_global_cleanup();
+  return core_->exporter->flush(timeout);
+}
+
+size_t Logger::shutdown(std::chrono::milliseconds timeout)
+{
+  if (!core_ || !core_->ownsExporter || !core_->exporter)
+  {
+    return 0;
+  }
+  return core_->exporter->shutdown(timeout);
 }
 
 std::string Logger::formatEndpoint(const std::string &endpoint, bool insecure)
@@ -94,168 +201,95 @@ std::string Logger::formatEndpoint(const std::string &endpoint, bool insecure)
   return oss.str();
 }
 
-void Logger::logMessage(LogLevel level,
-                        const std::string &message,
-                        const std::exception *err,
-                        const std::vector<Attribute> &attrs)
+VIGILANT_NOINLINE void Logger::logMessage(Callsite *site,
+                                          LogLevel level,
+                                          const std::string &message,
+                                          const std::exception *err,
+                                          const std::vector<Attribute> &attrs)
 {
-  if (noop_)
+  if (!admit(level, site))
     return;
 
-  LogMessage lm;
-  lm.timestamp = std::chrono::system_clock::now();
-  lm.body = message;
-  lm.level = level;
-
-  lm.attributes["service.name"] = serviceName_;
+  LogMessage lm = startMessage(site, level, message, attrs.size());
   for (auto &attr : attrs)
   {
-    lm.attributes[attr.key] = attr.value;
+    lm.attributes.emplace_back(attr);
   }
-  if (err != nullptr)
-  {
-    lm.attributes["error"] = err->what();
-  }
-
-  {
-    std::lock_guard<std::mutex> lock(queueMutex_);
-    logQueue_.push(std::move(lm));
-  }
-  condition_.notify_all();
-
-  logPassthrough(level, message, attrs);
+  finishMessage(std::move(lm), err);
 }
 
-void Logger::logPassthrough(LogLevel level,
-                            const std::string &message,
-                            const std::vector<Attribute> &attrs)
+VIGILANT_NOINLINE void Logger::logMessage(Callsite *site,
+                                          LogLevel level,
+                                          const std::string &message,
+                                          const std::exception *err,
+                                          KeyValue *fields,
+                                          size_t count)
 {
-  if (!passthrough_)
-    return;
-  std::ostringstream oss;
-  oss << "[" << logLevelToString(level) << "] " << message << " {";
-  for (auto &a : attrs)
+  LogMessage lm = startMessage(site, level, message, count);
+  for (size_t i = 0; i < count; ++i)
   {
-    oss << a.key << "=" << a.value << " ";
+    lm.attributes.push_back(std::move(fields[i]));
   }
-  oss << "}";
-  std::cout << oss.str() << std::endl;
+  finishMessage(std::move(lm), err);
 }
 
-void Logger::runBatcher()
+LogMessage Logger::startMessage(Callsite *site, LogLevel level, const std::string &message, size_t fields) const
 {
-  std::vector<LogMessage> batch;
-  batch.reserve(maxBatchSize_);
-
-  auto nextSendTime = std::chrono::steady_clock::now() + batchInterval_;
+  LogMessage lm;
+  lm.timestamp = std::chrono::system_clock::now();
+  lm.body = message;
+  lm.level = level;
+  lm.callsite = site;
 
-  while (true)
+  // Room for service.name, the span ids, a few context attributes and
+  // error.
+  lm.attributes.reserve(fields + 6);
+  lm.attributes.emplace_back(Key("service.name"), core_->serviceName);
+  if (const Span *span = Span::current())
   {
-    std::unique_lock<std::mutex> lock(queueMutex_);
-    condition_.wait_until(lock, nextSendTime, [&]()
-                          { return !logQueue_.empty() || stopWorker_; });
-
-    if (stopWorker_ && logQueue_.empty())
-    {
-      if (!batch.empty())
-      {
-        sendBatch(batch);
-      }
-      break;
-    }
-
-    while (!logQueue_.empty() && batch.size() < maxBatchSize_)
-    {
-      batch.push_back(std::move(logQueue_.front()));
-      logQueue_.pop();
-    }
-    lock.unlock();
-
-    if (batch.size() >= maxBatchSize_)
-    {
-      sendBatch(batch);
-    }
-
-    auto now = std::chrono::steady_clock::now();
-    if (now >= nextSendTime && !batch.empty())
-    {
-      sendBatch(batch);
-    }
-
-    nextSendTime = std::chrono::steady_clock::now() + batchInterval_;
+    lm.attributes.emplace_back(Key("trace_id"), span->traceIdHex());
+    lm.attributes.emplace_back(Key("span_id"), span->spanIdHex());
   }
+  ScopedContext::forEach([&](const KeyValue &attr)
+                         { lm.attributes.emplace_back(attr); });
+  return lm;
 }
 
-void Logger::sendBatch(std::vector<LogMessage> &batch)
+VIGILANT_NOINLINE void Logger::finishMessage(LogMessage lm, const std::exception *err) const
 {
-  if (batch.empty())
+  if (err != nullptr)
   {
-    return;
+    // Leaves out finishMessage and logMessage. Every logging method reaches
+    // logMessage from an inline wrapper, so in an optimized build the trace
+    // starts at its caller.
+    lm.attributes.emplace_back(Key("error"), err->what());
+    lm.exception = captureException(*err, 2);
   }
+  lm.bound = bound_;
 
-  nlohmann::json jsonPayload;
-  jsonPayload["token"] = token_;
-  jsonPayload["type"] = "logs";
+  logPassthrough(lm);
+  core_->exporter->enqueue(std::move(lm));
+}
 
-  nlohmann::json logsArray = nlohmann::json::array();
-  for (auto &msg : batch)
+void Logger::logPassthrough(const LogMessage &lm) const
+{
+  if (!core_->passthrough)
+    return;
+  std::ostringstream oss;
+  oss << "[" << logLevelToString(lm.level) << "] " << lm.body << " {";
+  for (auto &a : lm.attributes)
   {
-    nlohmann::json msgJson;
-    msgJson["timestamp"] = timePointToString(msg.timestamp);
-    msgJson["body"] = msg.body;
-    msgJson["level"] = logLevelToString(msg.level);
-
-    nlohmann::json attributesJson;
-    for (auto &kv : msg.attributes)
-    {
-      attributesJson[kv.first] = kv.second;
-    }
-    msgJson["attributes"] = attributesJson;
-
-    logsArray.push_back(msgJson);
+    oss << a.key() << "=" << a.value << " ";
   }
-
-  jsonPayload["logs"] = logsArray;
-  std::string payloadStr = jsonPayload.dump();
-
-  CURL *curl = curl_easy_init();
-  if (curl)
+  if (bound_)
   {
-    struct curl_slist *headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-
-    curl_easy_setopt(curl, CURLOPT_URL, endpoint_.c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payloadStr.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)payloadStr.size());
-
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK)
+    for (auto &entry : bound_->entries)
     {
-      std::cerr << "Failed to send logs: " << curl_easy_strerror(res) << std::endl;
+      oss << entry.key << "=" << entry.value << " ";
     }
-
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
   }
-
-  batch.clear();
-}
-
-std::string Logger::timePointToString(const std::chrono::system_clock::time_point &tp)
-{
-  auto tt = std::chrono::system_clock::to_time_t(tp);
-  std::tm *gmt = std::gmtime(&tt);
-
-  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-      tp.time_since_epoch() % std::chrono::seconds(1));
-
-  char buffer[32];
-  std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", gmt);
-
-  std::ostringstream oss;
-  oss << buffer << '.' << std::setfill('0') << std::setw(3) << ms.count() << 'Z';
-  return oss.str();
+  oss << "}";
+  std::cout << oss.str() << std::endl;
 }
 
 LoggerBuilder::LoggerBuilder()
@@ -266,7 +300,32 @@ LoggerBuilder::LoggerBuilder()
       insecure_(false),
       noop_(false),
       maxBatchSize_(1000),
-      batchInterval_(std::chrono::milliseconds(100))
+      batchInterval_(std::chrono::milliseconds(100)),
+      sink_(nullptr),
+      unixSocketPath_(),
+      exporter_(nullptr),
+      connectTimeout_(0),
+      requestTimeout_(0),
+      lowSpeedLimit_(-1),
+      lowSpeedTime_(0),
+      crashLogPath_(),
+      crashLogCapacity_(512),
+      adaptiveBatching_(false),
+      minBatchSize_(1),
+      minBatchInterval_(std::chrono::milliseconds(10)),
+      maxBatchInterval_(std::chrono::milliseconds(5000)),
+      targetLatency_(std::chrono::milliseconds(1000)),
+      workerName_("vigilant"),
+      workerCpus_(),
+      workerNice_(0),
+      workerSchedPolicy_(-1),
+      workerSchedPriority_(0),
+      executor_(),
+      sampling_(),
+      dedupWindow_(0),
+      dedupCapacity_(1024),
+      metricsInterval_(std::chrono::seconds(10)),
+      traceInterval_(std::chrono::seconds(1))
 {
 }
 
@@ -322,7 +381,202 @@ LoggerBuilder &LoggerBuilder::withBatchInterval(std::chrono::milliseconds batchI
   return *this;
 }
 
+LoggerBuilder &LoggerBuilder::withSink(std::shared_ptr<Sink> sink)
+{
+  sink_ = std::move(sink);
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withUnixSocket(const std::string &path)
+{
+  unixSocketPath_ = path;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withExporter(std::shared_ptr<Exporter> exporter)
+{
+  exporter_ = std::move(exporter);
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withConnectTimeout(std::chrono::milliseconds timeout)
+{
+  connectTimeout_ = timeout;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withRequestTimeout(std::chrono::milliseconds timeout)
+{
+  requestTimeout_ = timeout;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withLowSpeedLimit(long bytesPerSecond, std::chrono::seconds duration)
+{
+  lowSpeedLimit_ = bytesPerSecond;
+  lowSpeedTime_ = duration;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withCrashLog(const std::string &path, size_t capacity)
+{
+  crashLogPath_ = path;
+  crashLogCapacity_ = capacity;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withAdaptiveBatching(std::chrono::milliseconds targetLatency,
+                                                   size_t minBatchSize,
+                                                   std::chrono::milliseconds minInterval,
+                                                   std::chrono::milliseconds maxInterval)
+{
+  adaptiveBatching_ = true;
+  targetLatency_ = targetLatency;
+  minBatchSize_ = minBatchSize;
+  minBatchInterval_ = minInterval;
+  maxBatchInterval_ = maxInterval;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withWorkerName(const std::string &name)
+{
+  workerName_ = name;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withWorkerCpuAffinity(const std::vector<int> &cpus)
+{
+  workerCpus_ = cpus;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withWorkerNice(int nice)
+{
+  workerNice_ = nice;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withWorkerScheduling(int policy, int priority)
+{
+  workerSchedPolicy_ = policy;
+  workerSchedPriority_ = priority;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withExecutor(std::function<void(std::function<void()>)> executor)
+{
+  executor_ = std::move(executor);
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withSampleRate(LogLevel level, double rate)
+{
+  sampling_.levelRates[static_cast<size_t>(level)] = rate;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withCallsiteRateLimit(double recordsPerSecond, double burst)
+{
+  sampling_.callsiteRate = recordsPerSecond;
+  sampling_.callsiteBurst = burst;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withSamplingReportInterval(std::chrono::milliseconds interval)
+{
+  sampling_.reportInterval = interval;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withDeduplication(std::chrono::milliseconds window, size_t capacity)
+{
+  dedupWindow_ = window;
+  dedupCapacity_ = capacity;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withMetricsInterval(std::chrono::milliseconds interval)
+{
+  metricsInterval_ = interval;
+  return *this;
+}
+
+LoggerBuilder &LoggerBuilder::withTraceInterval(std::chrono::milliseconds interval)
+{
+  traceInterval_ = interval;
+  return *this;
+}
+
 Logger LoggerBuilder::build()
 {
-  return Logger(serviceName_, endpoint_, token_, passthrough_, insecure_, noop_, maxBatchSize_, batchInterval_);
-}
\ No newline at end of file
+  if (noop_)
+  {
+    return Logger(serviceName_, nullptr, passthrough_, true, false);
+  }
+  if (exporter_)
+  {
+    return Logger(serviceName_, exporter_, passthrough_, noop_);
+  }
+  return Logger(serviceName_, buildExporter(), passthrough_, noop_, true);
+}
+
+std::shared_ptr<Exporter> LoggerBuilder::buildExporter()
+{
+  return std::make_shared<Exporter>(exporterOptions());
+}
+
+ExporterOptions LoggerBuilder::exporterOptions()
+{
+  ExporterOptions options;
+  options.token = token_;
+  options.maxBatchSize = maxBatchSize_;
+  options.batchInterval = batchInterval_;
+  options.crashLogPath = crashLogPath_;
+  options.crashLogCapacity = crashLogCapacity_;
+  options.adaptiveBatching = adaptiveBatching_;
+  options.minBatchSize = minBatchSize_;
+  options.minBatchInterval = minBatchInterval_;
+  options.maxBatchInterval = maxBatchInterval_;
+  options.targetLatency = targetLatency_;
+  options.workerName = workerName_;
+  options.workerCpus = workerCpus_;
+  options.workerNice = workerNice_;
+  options.workerSchedPolicy = workerSchedPolicy_;
+  options.workerSchedPriority = workerSchedPriority_;
+  options.executor = executor_;
+  options.sampling = sampling_;
+  options.dedupWindow = dedupWindow_;
+  options.dedupCapacity = dedupCapacity_;
+  options.metricsInterval = metricsInterval_;
+  options.traceInterval = traceInterval_;
+  options.sink = sink_;
+  if (!options.sink && !unixSocketPath_.empty())
+  {
+    auto fallback = std::make_shared<HttpSink>(Logger::formatEndpoint(endpoint_, insecure_), httpTimeouts());
+    options.sink = std::make_shared<UnixSocketSink>(unixSocketPath_, std::move(fallback), httpTimeouts());
+  }
+  else if (!options.sink)
+  {
+    options.sink = std::make_shared<HttpSink>(Logger::formatEndpoint(endpoint_, insecure_), httpTimeouts());
+  }
+  return options;
+}
+
+HttpTimeouts LoggerBuilder::httpTimeouts() const
+{
+  HttpTimeouts timeouts = HttpTimeouts::forBatchInterval(batchInterval_);
+  if (connectTimeout_.count() > 0)
+  {
+    timeouts.connect = connectTimeout_;
+  }
+  if (requestTimeout_.count() > 0)
+  {
+    timeouts.request = requestTimeout_;
+  }
+  if (lowSpeedLimit_ >= 0)
+  {
+    timeouts.lowSpeedLimit = lowSpeedLimit_;
+    timeouts.lowSpeedTime = lowSpeedTime_;
+  }
+  return timeouts;
+}
@@ -8,69 +8,37 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <deque>
 #include <chrono>
 #include <iostream>
 #include <sstream>
 #include <map>
 #include <ctime>
+#include <memory>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <initializer_list>
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
 
-enum class LogLevel
-{
-  Debug,
-  Info,
-  Warn,
-  Error
-};
-
-struct Attribute
-{
-  std::string key;
-  std::string value;
-};
-
-struct LogMessage
-{
-  std::chrono::system_clock::time_point timestamp;
-  std::string body;
-  LogLevel level;
-  std::map<std::string, std::string> attributes;
-};
-
-inline std::string logLevelToString(LogLevel level)
-{
-  switch (level)
-  {
-  case LogLevel::Debug:
-    return "DEBUG";
-  case LogLevel::Info:
-    return "INFO";
-  case LogLevel::Warn:
-    return "WARNING";
-  case LogLevel::Error:
-    return "ERROR";
-  }
-  return "UNKNOWN";
-}
-
-inline std::string timePointToString(const std::chrono::system_clock::time_point &tp)
-{
-  std::time_t tt = std::chrono::system_clock::to_time_t(tp);
-  std::tm tm{};
-#if defined(_WIN32)
-  localtime_s(&tm, &tt);
-#else
-  localtime_r(&tt, &tm);
-#endif
-  char buffer[32];
-  std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm);
-  return std::string(buffer);
-}
+#include "log_message.h"
+#include "sink.h"
+#include "exporter.h"
+#include "context.h"
+#include "span.h"
 
+// A Logger is a cheap handle: copies share the same service name and
+// Exporter, so it can be passed by value, moved, and stored in containers.
+// The pipeline shuts down when the last copy of a Logger that owns its
+// Exporter goes away.
 class Logger
 {
 public:
+  // A default-constructed or moved-from Logger discards everything, like a
+  // noop one.
+  Logger() = default;
+
   Logger(const std::string &name,
          const std::string &endpoint,
          const std::string &token,
@@ -78,47 +46,284 @@ public:
          bool insecure = false,
          bool noop = false,
          size_t maxBatchSize = 100,
-         std::chrono::milliseconds batchInterval = std::chrono::milliseconds(100));
+         std::chrono::milliseconds batchInterval = std::chrono::milliseconds(100),
+         std::shared_ptr<Sink> sink = nullptr);
+
+  // Attaches to an existing Exporter. Shutting this Logger down leaves the
+  // Exporter running for the other Loggers that share it. A null exporter
+  // gives a noop Logger.
+  Logger(const std::string &name,
+         std::shared_ptr<Exporter> exporter,
+         bool passthrough = false,
+         bool noop = false);
+
+  Logger(const Logger &) = default;
+  Logger(Logger &&) noexcept = default;
+  Logger &operator=(const Logger &) = default;
+  Logger &operator=(Logger &&) noexcept = default;
+  ~Logger() = default;
+
+  void debug(const std::string &message, const std::vector<Attribute> &attrs = {})
+  {
+    logMessage(nullptr, LogLevel::Debug, message, nullptr, attrs);
+  }
+
+  void info(const std::string &message, const std::vector<Attribute> &attrs = {})
+  {
+    logMessage(nullptr, LogLevel::Info, message, nullptr, attrs);
+  }
+
+  void warn(const std::string &message, const std::vector<Attribute> &attrs = {})
+  {
+    logMessage(nullptr, LogLevel::Warn, message, nullptr, attrs);
+  }
+
+  void error(const std::string &message, const std::exception *err = nullptr, const std::vector<Attribute> &attrs = {})
+  {
+    logMessage(nullptr, LogLevel::Error, message, err, attrs);
+  }
+
+  // Variadic forms taking kv() pairs or Attributes, which are moved from the
+  // caller's stack into the record without building a vector:
+  //
+  //   logger.info("request finished", kv("status", 200), kv("route", route));
+  template <typename... Fields, typename = EnableIfFields<Fields...>>
+  void debug(const std::string &message, Fields &&...fields)
+  {
+    logFields(nullptr, LogLevel::Debug, message, nullptr, std::forward<Fields>(fields)...);
+  }
+
+  template <typename... Fields, typename = EnableIfFields<Fields...>>
+  void info(const std::string &message, Fields &&...fields)
+  {
+    logFields(nullptr, LogLevel::Info, message, nullptr, std::forward<Fields>(fields)...);
+  }
+
+  template <typename... Fields, typename = EnableIfFields<Fields...>>
+  void warn(const std::string &message, Fields &&...fields)
+  {
+    logFields(nullptr, LogLevel::Warn, message, nullptr, std::forward<Fields>(fields)...);
+  }
+
+  template <typename... Fields, typename = EnableIfFields<Fields...>>
+  void error(const std::string &message, Fields &&...fields)
+  {
+    logFields(nullptr, LogLevel::Error, message, nullptr, std::forward<Fields>(fields)...);
+  }
+
+  template <typename... Fields, typename = EnableIfFields<Fields...>>
+  void error(const std::string &message, const std::exception *err, Fields &&...fields)
+  {
+    logFields(nullptr, LogLevel::Error, message, err, std::forward<Fields>(fields)...);
+  }
+
+  // Logs at the given level on behalf of a call site, which is subject to
+  // the per-callsite rate limit. Normally called through the VIGILANT_*
+  // macros below rather than directly.
+  void log(Callsite &site, LogLevel level, const std::string &message, const std::vector<Attribute> &attrs = {})
+  {
+    logMessage(&site, level, message, nullptr, attrs);
+  }
 
-  ~Logger();
+  void log(Callsite &site, LogLevel level, const std::string &message, const std::exception *err, const std::vector<Attribute> &attrs = {})
+  {
+    logMessage(&site, level, message, err, attrs);
+  }
+
+  template <typename... Fields, typename = EnableIfFields<Fields...>>
+  void log(Callsite &site, LogLevel level, const std::string &message, Fields &&...fields)
+  {
+    logFields(&site, level, message, nullptr, std::forward<Fields>(fields)...);
+  }
+
+  template <typename... Fields, typename = EnableIfFields<Fields...>>
+  void log(Callsite &site, LogLevel level, const std::string &message, const std::exception *err, Fields &&...fields)
+  {
+    logFields(&site, level, message, err, std::forward<Fields>(fields)...);
+  }
+
+  // Returns a child Logger that adds attrs to every record it logs, on top
+  // of any attributes bound to this Logger. The attributes are encoded once,
+  // here, rather than on every call. The child shares this Logger's pipeline.
+  Logger with(const std::vector<Attribute> &attrs) const;
 
-  Logger(const Logger &) = delete;
-  Logger &operator=(const Logger &) = delete;
+  // Metric instruments sent through this Logger's Exporter, tagged with its
+  // service name; see metrics.h. A noop Logger returns instruments that
+  // discard everything.
+  Counter counter(const std::string &name, const std::vector<Attribute> &attrs = {}) const;
+  Gauge gauge(const std::string &name, const std::vector<Attribute> &attrs = {}) const;
+  Histogram histogram(const std::string &name, const std::vector<double> &bounds, const std::vector<Attribute> &attrs = {}) const;
 
-  void debug(const std::string &message, const std::vector<Attribute> &attrs = {});
-  void info(const std::string &message, const std::vector<Attribute> &attrs = {});
-  void warn(const std::string &message, const std::vector<Attribute> &attrs = {});
-  void error(const std::string &message, const std::exception *err = nullptr, const std::vector<Attribute> &attrs = {});
+  // Starts a span named name that ends when the returned Span is destroyed;
+  // see span.h. Records logged on this thread while it is alive carry its
+  // trace_id and span_id. A noop Logger returns a span that records nothing.
+  Span startSpan(std::string name, const std::vector<Attribute> &attrs = {}) const;
 
-  void shutdown();
+  // Starts the export pipeline and connection setup before the first
+  // record; see Exporter::prewarm.
+  void prewarm();
+
+  // Forces out everything logged so far; see Exporter::flush.
+  size_t flush(std::chrono::milliseconds timeout);
+
+  // Shuts down the Logger's own Exporter; see Exporter::shutdown. This
+  // affects every copy of the Logger. A Logger attached to a shared Exporter
+  // leaves it running and returns 0.
+  size_t shutdown(std::chrono::milliseconds timeout = std::chrono::milliseconds::max());
 
 private:
-  std::string serviceName_;
-  std::string endpoint_;
-  std::string token_;
-  bool passthrough_;
-  bool noop_;
-  size_t maxBatchSize_;
-  std::chrono::milliseconds batchInterval_;
-  std::atomic<bool> stopWorker_;
-  std::thread workerThread_;
-  std::mutex queueMutex_;
-  std::condition_variable condition_;
-  std::queue<LogMessage> logQueue_;
+  friend class LoggerBuilder;
+
+  // State shared by every copy. A noop Logger has no core at all.
+  struct Core
+  {
+    std::string serviceName;
+    bool passthrough;
+    std::shared_ptr<Exporter> exporter;
+    bool ownsExporter;
+    // serviceName interned in the Exporter's tracer, so that spans need
+    // not copy it.
+    const std::string *spanService;
+  };
+
+  std::shared_ptr<const Core> core_;
+  std::shared_ptr<const BoundAttributes> bound_;
+
+  Logger(const std::string &name,
+         std::shared_ptr<Exporter> exporter,
+         bool passthrough,
+         bool noop,
+         bool ownsExporter);
 
   static std::string formatEndpoint(const std::string &endpoint, bool insecure);
-  void logMessage(LogLevel level,
+  bool admit(LogLevel level, Callsite *site) const
+  {
+    return core_ && core_->exporter->admit(level, site);
+  }
+
+  template <typename... Fields>
+  void logFields(Callsite *site, LogLevel level, const std::string &message, const std::exception *err, Fields &&...fields)
+  {
+    if (!admit(level, site))
+      return;
+    KeyValue items[] = {KeyValue(std::forward<Fields>(fields))...};
+    logMessage(site, level, message, err, items, sizeof...(Fields));
+  }
+
+  void logMessage(Callsite *site,
+                  LogLevel level,
                   const std::string &message,
                   const std::exception *err,
                   const std::vector<Attribute> &attrs);
-  void logPassthrough(LogLevel level,
-                      const std::string &message,
-                      const std::vector<Attribute> &attrs);
-  void runBatcher();
-  void sendBatch(std::vector<LogMessage> &batch);
-  std::string timePointToString(const std::chrono::system_clock::time_point &tp);
+  void logMessage(Callsite *site,
+                  LogLevel level,
+                  const std::string &message,
+                  const std::exception *err,
+                  KeyValue *fields,
+                  size_t count);
+  std::vector<Attribute> metricAttributes(const std::vector<Attribute> &attrs) const;
+  LogMessage startMessage(Callsite *site, LogLevel level, const std::string &message, size_t fields) const;
+  void finishMessage(LogMessage lm, const std::exception *err) const;
+  void logPassthrough(const LogMessage &lm) const;
+};
+
+// Swallows one element of a braced attribute list such as {"key", value}
+// without constructing an Attribute.
+struct NullArgument
+{
+  template <typename... T>
+  constexpr NullArgument(T &&...) {}
+};
+
+// Has the same interface as Logger but every method is an empty inline
+// function template. Arguments are taken as they are written, without being
+// converted to std::string or Attribute, so call sites compile away
+// entirely. Use it in place of Logger in builds where telemetry is
+// disabled.
+class NullLogger
+{
+public:
+  using Attributes = std::initializer_list<NullArgument>;
+
+  template <typename... Args>
+  void debug(Args &&...) {}
+  template <typename M>
+  void debug(M &&, Attributes) {}
+  template <typename... Args>
+  void info(Args &&...) {}
+  template <typename M>
+  void info(M &&, Attributes) {}
+  template <typename... Args>
+  void warn(Args &&...) {}
+  template <typename M>
+  void warn(M &&, Attributes) {}
+  template <typename... Args>
+  void error(Args &&...) {}
+  template <typename M>
+  void error(M &&, Attributes) {}
+  template <typename M, typename E>
+  void error(M &&, E &&, Attributes) {}
+
+  template <typename... Args>
+  void log(Args &&...) {}
+  template <typename S, typename L, typename M>
+  void log(S &&, L &&, M &&, Attributes) {}
+  template <typename S, typename L, typename M, typename E>
+  void log(S &&, L &&, M &&, E &&, Attributes) {}
+
+  template <typename A>
+  NullLogger with(A &&) const { return *this; }
+  NullLogger with(Attributes) const { return *this; }
+
+  template <typename N, typename A>
+  Counter counter(N &&, A &&) const { return Counter(); }
+  template <typename N>
+  Counter counter(N &&, Attributes = {}) const { return Counter(); }
+  template <typename N, typename A>
+  Gauge gauge(N &&, A &&) const { return Gauge(); }
+  template <typename N>
+  Gauge gauge(N &&, Attributes = {}) const { return Gauge(); }
+  template <typename N, typename B, typename A>
+  Histogram histogram(N &&, B &&, A &&) const { return Histogram(); }
+  template <typename N, typename B>
+  Histogram histogram(N &&, B &&, Attributes = {}) const { return Histogram(); }
+  template <typename N, typename A>
+  Histogram histogram(N &&, Attributes, A &&) const { return Histogram(); }
+  template <typename N>
+  Histogram histogram(N &&, Attributes, Attributes = {}) const { return Histogram(); }
+
+  template <typename N, typename A>
+  NullSpan startSpan(N &&, A &&) const { return NullSpan(); }
+  template <typename N>
+  NullSpan startSpan(N &&, Attributes = {}) const { return NullSpan(); }
+
+  void prewarm() {}
+  size_t flush(std::chrono::milliseconds) { return 0; }
+  size_t shutdown(std::chrono::milliseconds = std::chrono::milliseconds::max()) { return 0; }
 };
 
+// Logging macros that tag each record with its source location and give
+// each call site its own rate limit:
+//
+//   VIGILANT_WARN(logger, "retrying", kv("attempt", attempt));
+//
+// The arguments after the logger are those of the matching Logger method.
+// With a NullLogger the whole statement, Callsite included, is discarded.
+#define VIGILANT_LOG(logger, level, ...)                                                        \
+  do                                                                                            \
+  {                                                                                             \
+    if constexpr (!std::is_same<typename std::decay<decltype(logger)>::type, NullLogger>::value) \
+    {                                                                                           \
+      static Callsite vigilantCallsite(__FILE__, __LINE__, __func__, level);                    \
+      (logger).log(vigilantCallsite, level, __VA_ARGS__);                                       \
+    }                                                                                           \
+  } while (0)
+
+#define VIGILANT_DEBUG(logger, ...) VIGILANT_LOG(logger, LogLevel::Debug, __VA_ARGS__)
+#define VIGILANT_INFO(logger, ...) VIGILANT_LOG(logger, LogLevel::Info, __VA_ARGS__)
+#define VIGILANT_WARN(logger, ...) VIGILANT_LOG(logger, LogLevel::Warn, __VA_ARGS__)
+#define VIGILANT_ERROR(logger, ...) VIGILANT_LOG(logger, LogLevel::Error, __VA_ARGS__)
+
 class LoggerBuilder
 {
 public:
@@ -137,9 +342,43 @@ public:
   LoggerBuilder &withNoop(bool noop = true);
   LoggerBuilder &withMaxBatchSize(size_t maxBatchSize);
   LoggerBuilder &withBatchInterval(std::chrono::milliseconds batchInterval);
+  LoggerBuilder &withSink(std::shared_ptr<Sink> sink);
+  LoggerBuilder &withUnixSocket(const std::string &path);
+  LoggerBuilder &withExporter(std::shared_ptr<Exporter> exporter);
+  LoggerBuilder &withConnectTimeout(std::chrono::milliseconds timeout);
+  LoggerBuilder &withRequestTimeout(std::chrono::milliseconds timeout);
+  LoggerBuilder &withLowSpeedLimit(long bytesPerSecond, std::chrono::seconds duration);
+  LoggerBuilder &withCrashLog(const std::string &path, size_t capacity = 512);
+  // Lets the exporter retune batch size and interval to load, keeping the
+  // batch size within [minBatchSize, maxBatchSize] and the interval within
+  // [minInterval, maxInterval].
+  LoggerBuilder &withAdaptiveBatching(std::chrono::milliseconds targetLatency,
+                                      size_t minBatchSize = 1,
+                                      std::chrono::milliseconds minInterval = std::chrono::milliseconds(10),
+                                      std::chrono::milliseconds maxInterval = std::chrono::milliseconds(5000));
+  LoggerBuilder &withWorkerName(const std::string &name);
+  LoggerBuilder &withWorkerCpuAffinity(const std::vector<int> &cpus);
+  LoggerBuilder &withWorkerNice(int nice);
+  LoggerBuilder &withWorkerScheduling(int policy, int priority);
+  LoggerBuilder &withExecutor(std::function<void(std::function<void()>)> executor);
+  // Keeps only this fraction of the records logged at level.
+  LoggerBuilder &withSampleRate(LogLevel level, double rate);
+  // Limits each call site using the VIGILANT_* macros to recordsPerSecond,
+  // with bursts of up to burst records.
+  LoggerBuilder &withCallsiteRateLimit(double recordsPerSecond, double burst = 10.0);
+  LoggerBuilder &withSamplingReportInterval(std::chrono::milliseconds interval);
+  // Collapses identical records seen within window into one summary record;
+  // see ExporterOptions::dedupWindow.
+  LoggerBuilder &withDeduplication(std::chrono::milliseconds window, size_t capacity = 1024);
+  LoggerBuilder &withMetricsInterval(std::chrono::milliseconds interval);
+  LoggerBuilder &withTraceInterval(std::chrono::milliseconds interval);
 
   Logger build();
 
+  // Creates an Exporter from the transport and batching settings so that it
+  // can be shared by several Loggers through withExporter().
+  std::shared_ptr<Exporter> buildExporter();
+
 private:
   std::string serviceName_;
   std::string endpoint_;
@@ -149,6 +388,34 @@ private:
   bool noop_;
   size_t maxBatchSize_;
   std::chrono::milliseconds batchInterval_;
+  std::shared_ptr<Sink> sink_;
+  std::string unixSocketPath_;
+  std::shared_ptr<Exporter> exporter_;
+  std::chrono::milliseconds connectTimeout_;
+  std::chrono::milliseconds requestTimeout_;
+  long lowSpeedLimit_;
+  std::chrono::seconds lowSpeedTime_;
+  std::string crashLogPath_;
+  size_t crashLogCapacity_;
+  bool adaptiveBatching_;
+  size_t minBatchSize_;
+  std::chrono::milliseconds minBatchInterval_;
+  std::chrono::milliseconds maxBatchInterval_;
+  std::chrono::milliseconds targetLatency_;
+  std::string workerName_;
+  std::vector<int> workerCpus_;
+  int workerNice_;
+  int workerSchedPolicy_;
+  int workerSchedPriority_;
+  std::function<void(std::function<void()>)> executor_;
+  SamplingOptions sampling_;
+  std::chrono::milliseconds dedupWindow_;
+  size_t dedupCapacity_;
+  std::chrono::milliseconds metricsInterval_;
+  std::chrono::milliseconds traceInterval_;
+
+  ExporterOptions exporterOptions();
+  HttpTimeouts httpTimeouts() const;
 };
 
 #endif // LOGGER_H
@@ -0,0 +1,298 @@
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <iostream>
+#include <algorithm>
+#include <new>
+
+#include "metrics.h"
+#include "json_writer.h"
+
+namespace
+{
+  std::atomic<size_t> nextStripe(0);
+
+  void addDouble(std::atomic<double> &target, double value)
+  {
+    double current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  void appendNumber(std::string &out, double value)
+  {
+    appendJsonValue(out, AttributeValue(value));
+  }
+}
+
+size_t metricStripe()
+{
+  static thread_local size_t stripe = nextStripe.fetch_add(1, std::memory_order_relaxed) % kMetricStripes;
+  return stripe;
+}
+
+HistogramState::HistogramState(std::vector<double> bucketBounds)
+    : bounds(std::move(bucketBounds))
+{
+  std::sort(bounds.begin(), bounds.end());
+  bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+  size_t perLine = 64 / sizeof(std::atomic<uint64_t>);
+  rowStride = (bounds.size() + 1 + perLine - 1) / perLine * perLine;
+  size_t count = rowStride * kMetricStripes;
+  void *raw = ::operator new[](count * sizeof(std::atomic<uint64_t>), std::align_val_t(64));
+  auto *cells = static_cast<std::atomic<uint64_t> *>(raw);
+  for (size_t i = 0; i < count; ++i)
+  {
+    new (&cells[i]) std::atomic<uint64_t>(0);
+  }
+  buckets.reset(cells);
+}
+
+void HistogramState::BucketsDeleter::operator()(std::atomic<uint64_t> *cells) const
+{
+  // std::atomic<uint64_t> is trivially destructible.
+  ::operator delete[](cells, std::align_val_t(64));
+}
+
+void HistogramState::record(double value)
+{
+  // Buckets are upper-inclusive; the last one catches everything above the
+  // highest bound.
+  size_t bucket = static_cast<size_t>(std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin());
+  size_t stripe = metricStripe();
+  buckets[stripe * rowStride + bucket].fetch_add(1, std::memory_order_relaxed);
+  addDouble(sums[stripe].value, value);
+}
+
+std::vector<double> Histogram::exponentialBounds(double start, double factor, size_t count)
+{
+  std::vector<double> bounds;
+  bounds.reserve(count);
+  double bound = start;
+  for (size_t i = 0; i < count; ++i)
+  {
+    bounds.push_back(bound);
+    bound *= factor;
+  }
+  return bounds;
+}
+
+MetricRegistry::MetricRegistry()
+    : empty_(true),
+      lastCollect_(std::chrono::system_clock::now())
+{
+}
+
+Counter MetricRegistry::counter(const std::string &name, const std::vector<Attribute> &attrs)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Instrument *instrument = find(Kind::Counter, name, attrs);
+  if (instrument == nullptr)
+  {
+    return Counter();
+  }
+  if (!instrument->counter)
+  {
+    instrument->counter = std::make_shared<CounterState>();
+  }
+  return Counter(instrument->counter);
+}
+
+Gauge MetricRegistry::gauge(const std::string &name, const std::vector<Attribute> &attrs)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Instrument *instrument = find(Kind::Gauge, name, attrs);
+  if (instrument == nullptr)
+  {
+    return Gauge();
+  }
+  if (!instrument->gauge)
+  {
+    instrument->gauge = std::make_shared<GaugeState>();
+  }
+  return Gauge(instrument->gauge);
+}
+
+Histogram MetricRegistry::histogram(const std::string &name, const std::vector<double> &bounds, const std::vector<Attribute> &attrs)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Instrument *instrument = find(Kind::Histogram, name, attrs);
+  if (instrument == nullptr)
+  {
+    return Histogram();
+  }
+  if (!instrument->histogram)
+  {
+    instrument->histogram = std::make_shared<HistogramState>(bounds);
+  }
+  else
+  {
+    std::vector<double> sorted = bounds;
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    if (sorted != instrument->histogram->bounds)
+    {
+      std::cerr << "Histogram " << name << " is already registered with different bounds" << std::endl;
+      return Histogram();
+    }
+  }
+  return Histogram(instrument->histogram);
+}
+
+MetricRegistry::Instrument *MetricRegistry::find(Kind kind, const std::string &name, const std::vector<Attribute> &attrs)
+{
+  std::string attributes;
+  for (auto &attr : attrs)
+  {
+    if (!attributes.empty())
+    {
+      attributes.push_back(',');
+    }
+    appendJsonMember(attributes, attr.key, attr.value);
+  }
+
+  std::string id = name;
+  id.push_back('\0');
+  id += attributes;
+  auto it = instruments_.find(id);
+  if (it == instruments_.end())
+  {
+    it = instruments_.emplace(std::move(id), Instrument{kind, name, std::move(attributes), nullptr, nullptr, nullptr}).first;
+    empty_.store(false, std::memory_order_relaxed);
+  }
+  else if (it->second.kind != kind)
+  {
+    std::cerr << "Metric " << name << " is already registered as a different kind" << std::endl;
+    return nullptr;
+  }
+  return &it->second;
+}
+
+size_t MetricRegistry::collect(std::string &out)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto now = std::chrono::system_clock::now();
+  auto start = lastCollect_;
+  lastCollect_ = now;
+
+  size_t written = 0;
+  auto begin = [&](const Instrument &instrument, const char *type, bool delta)
+  {
+    if (written++ > 0)
+    {
+      out.push_back(',');
+    }
+    out.append("{\"name\":");
+    appendJsonString(out, instrument.name);
+    out.append(",\"type\":\"");
+    out.append(type);
+    out.push_back('"');
+    if (delta)
+    {
+      out.append(",\"start_time\":\"");
+      appendTimestamp(out, start);
+      out.push_back('"');
+    }
+    out.append(",\"time\":\"");
+    appendTimestamp(out, now);
+    out.append("\",\"attributes\":{");
+    out.append(instrument.attributes);
+    out.push_back('}');
+  };
+
+  for (auto &item : instruments_)
+  {
+    const Instrument &instrument = item.second;
+    switch (instrument.kind)
+    {
+    case Kind::Counter:
+    {
+      int64_t value = 0;
+      for (auto &cell : instrument.counter->cells)
+      {
+        value += cell.value.exchange(0, std::memory_order_relaxed);
+      }
+      if (value == 0)
+        break;
+      begin(instrument, "counter", true);
+      out.append(",\"value\":");
+      appendJsonValue(out, AttributeValue(value));
+      out.push_back('}');
+      break;
+    }
+    case Kind::Gauge:
+    {
+      if (!instrument.gauge->set.load(std::memory_order_relaxed))
+        break;
+      begin(instrument, "gauge", false);
+      out.append(",\"value\":");
+      appendNumber(out, instrument.gauge->value.load(std::memory_order_relaxed));
+      out.push_back('}');
+      break;
+    }
+    case Kind::Histogram:
+    {
+      HistogramState &state = *instrument.histogram;
+      double sum = 0.0;
+      for (auto &stripeSum : state.sums)
+      {
+        sum += stripeSum.value.exchange(0.0, std::memory_order_relaxed);
+      }
+      uint64_t count = 0;
+      std::vector<uint64_t> buckets(state.bounds.size() + 1, 0);
+      for (size_t stripe = 0; stripe < kMetricStripes; ++stripe)
+      {
+        for (size_t i = 0; i < buckets.size(); ++i)
+        {
+          uint64_t n = state.buckets[stripe * state.rowStride + i].exchange(0, std::memory_order_relaxed);
+          buckets[i] += n;
+          count += n;
+        }
+      }
+      if (count == 0)
+        break;
+      begin(instrument, "histogram", true);
+      out.append(",\"count\":");
+      appendJsonValue(out, AttributeValue(count));
+      out.append(",\"sum\":");
+      appendNumber(out, sum);
+      out.append(",\"bounds\":[");
+      for (size_t i = 0; i < state.bounds.size(); ++i)
+      {
+        if (i > 0)
+          out.push_back(',');
+        appendNumber(out, state.bounds[i]);
+      }
+      out.append("],\"buckets\":[");
+      for (size_t i = 0; i < buckets.size(); ++i)
+      {
+        if (i > 0)
+          out.push_back(',');
+        appendJsonValue(out, AttributeValue(buckets[i]));
+      }
+      out.append("]}");
+      break;
+    }
+    }
+  }
+  return written;
+}
+
+void MetricRegistry::lockForFork()
+{
+  mutex_.lock();
+}
+
+void MetricRegistry::unlockForFork()
+{
+  mutex_.unlock();
+}
+
+void MetricRegistry::resetInChild()
+{
+  mutex_.unlock();
+  std::string discarded;
+  collect(discarded);
+}
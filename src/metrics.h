@@ -0,0 +1,193 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+#include "log_message.h"
+
+// Client-side metrics, aggregated in memory and sent by the Exporter every
+// metrics interval as a "metrics" payload through the same sink as the logs.
+//
+// Recording a value is a relaxed atomic operation on a cell chosen by the
+// calling thread. Cells are striped across cache lines so that threads
+// recording into the same instrument rarely touch the same line. Counters
+// and histograms are reported as deltas since the previous report; gauges
+// report their last value.
+constexpr size_t kMetricStripes = 8;
+
+// The stripe used by the calling thread.
+size_t metricStripe();
+
+struct alignas(64) MetricCell
+{
+  std::atomic<int64_t> value{0};
+};
+
+struct alignas(64) HistogramSum
+{
+  std::atomic<double> value{0.0};
+};
+
+struct CounterState
+{
+  MetricCell cells[kMetricStripes];
+};
+
+struct GaugeState
+{
+  std::atomic<double> value{0.0};
+  std::atomic<bool> set{false};
+};
+
+struct HistogramState
+{
+  explicit HistogramState(std::vector<double> bounds);
+
+  // Releases the cache-line-aligned bucket array.
+  struct BucketsDeleter
+  {
+    void operator()(std::atomic<uint64_t> *buckets) const;
+  };
+
+  std::vector<double> bounds;
+  // kMetricStripes rows of bounds.size() + 1 bucket counts, each row padded
+  // to a whole number of cache lines. The array starts on a cache line, so
+  // no two rows share one.
+  size_t rowStride;
+  std::unique_ptr<std::atomic<uint64_t>[], BucketsDeleter> buckets;
+  HistogramSum sums[kMetricStripes];
+
+  void record(double value);
+};
+
+// A monotonically increasing count, such as requests served.
+class Counter
+{
+public:
+  Counter() = default;
+
+  // Negative values are ignored; a count that goes down belongs in a Gauge.
+  void add(int64_t value = 1)
+  {
+    if (state_ && value > 0)
+    {
+      state_->cells[metricStripe()].value.fetch_add(value, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  friend class MetricRegistry;
+  explicit Counter(std::shared_ptr<CounterState> state) : state_(std::move(state)) {}
+  std::shared_ptr<CounterState> state_;
+};
+
+// A value that goes up and down, such as queue depth.
+class Gauge
+{
+public:
+  Gauge() = default;
+
+  void set(double value)
+  {
+    if (state_)
+    {
+      state_->value.store(value, std::memory_order_relaxed);
+      state_->set.store(true, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  friend class MetricRegistry;
+  explicit Gauge(std::shared_ptr<GaugeState> state) : state_(std::move(state)) {}
+  std::shared_ptr<GaugeState> state_;
+};
+
+// A distribution of values, such as request latency, counted into buckets
+// with fixed upper bounds.
+class Histogram
+{
+public:
+  Histogram() = default;
+
+  void record(double value)
+  {
+    if (state_)
+    {
+      state_->record(value);
+    }
+  }
+
+  // count bucket bounds growing geometrically from start by factor.
+  static std::vector<double> exponentialBounds(double start, double factor, size_t count);
+
+private:
+  friend class MetricRegistry;
+  explicit Histogram(std::shared_ptr<HistogramState> state) : state_(std::move(state)) {}
+  std::shared_ptr<HistogramState> state_;
+};
+
+// Owns every instrument of one Exporter. Instruments are identified by name
+// and attributes; asking for the same pair again returns the same
+// instrument. Asking for it as a different kind, or as a histogram with
+// different bounds, is reported and returns an instrument that discards
+// everything.
+class MetricRegistry
+{
+public:
+  MetricRegistry();
+
+  MetricRegistry(const MetricRegistry &) = delete;
+  MetricRegistry &operator=(const MetricRegistry &) = delete;
+
+  Counter counter(const std::string &name, const std::vector<Attribute> &attrs);
+  Gauge gauge(const std::string &name, const std::vector<Attribute> &attrs);
+  Histogram histogram(const std::string &name, const std::vector<double> &bounds, const std::vector<Attribute> &attrs);
+
+  bool empty() const { return empty_.load(std::memory_order_relaxed); }
+
+  // Appends the JSON for every instrument with something to report since
+  // the previous call to out, as comma-separated objects, and returns how
+  // many were written.
+  size_t collect(std::string &out);
+
+  // fork() support: the registry lock is held across fork(), and the child
+  // discards the values it inherited so they are not reported twice.
+  void lockForFork();
+  void unlockForFork();
+  void resetInChild();
+
+private:
+  enum class Kind
+  {
+    Counter,
+    Gauge,
+    Histogram
+  };
+
+  struct Instrument
+  {
+    Kind kind;
+    std::string name;
+    // "key":value members, already encoded.
+    std::string attributes;
+    std::shared_ptr<CounterState> counter;
+    std::shared_ptr<GaugeState> gauge;
+    std::shared_ptr<HistogramState> histogram;
+  };
+
+  std::mutex mutex_;
+  std::map<std::string, Instrument> instruments_;
+  std::atomic<bool> empty_;
+  std::chrono::system_clock::time_point lastCollect_;
+
+  Instrument *find(Kind kind, const std::string &name, const std::vector<Attribute> &attrs);
+};
+
+#endif // METRICS_H
@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <functional>
+
+#include "sampler.h"
+
+Sampler::Sampler(const SamplingOptions &options)
+    : enabled_(false),
+      thresholds_(),
+      interval_(0),
+      tolerance_(0),
+      reportInterval_(options.reportInterval)
+{
+  for (size_t i = 0; i < thresholds_.size(); ++i)
+  {
+    double rate = options.levelRates[i];
+    if (rate >= 1.0 || std::isnan(rate))
+    {
+      thresholds_[i] = kAlways;
+    }
+    else
+    {
+      thresholds_[i] = rate <= 0.0 ? 0 : static_cast<uint64_t>(std::ldexp(rate, 64));
+      enabled_ = true;
+    }
+    suppressed_[i].store(0, std::memory_order_relaxed);
+  }
+
+  if (options.callsiteRate > 0.0)
+  {
+    interval_ = std::max<int64_t>(1, static_cast<int64_t>(1e9 / options.callsiteRate));
+    tolerance_ = static_cast<int64_t>(std::max(options.callsiteBurst - 1.0, 0.0) * static_cast<double>(interval_));
+    enabled_ = true;
+  }
+}
+
+std::array<uint64_t, 4> Sampler::takeSuppressed()
+{
+  std::array<uint64_t, 4> counts;
+  for (size_t i = 0; i < counts.size(); ++i)
+  {
+    counts[i] = suppressed_[i].exchange(0, std::memory_order_relaxed);
+  }
+  return counts;
+}
+
+bool Sampler::takeToken(Callsite &site)
+{
+  // GCRA: each record pushes the call site's next free time forward by one
+  // interval, and a record is allowed while that time is no more than a
+  // burst ahead of now.
+  int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+  int64_t nextFree = site.nextFree.load(std::memory_order_relaxed);
+  while (true)
+  {
+    int64_t start = std::max(nextFree, now);
+    if (start - now > tolerance_)
+    {
+      return false;
+    }
+    if (site.nextFree.compare_exchange_weak(nextFree, start + interval_, std::memory_order_relaxed))
+    {
+      return true;
+    }
+  }
+}
+
+uint64_t Sampler::nextRandom()
+{
+  // splitmix64 over a per-thread counter seeded from the thread id.
+  static thread_local uint64_t state =
+      std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+      static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+  uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
@@ -0,0 +1,77 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+#include "log_message.h"
+#include "callsite.h"
+
+struct SamplingOptions
+{
+  // Fraction of records kept at each level, indexed by LogLevel. Records are
+  // dropped at random before they are built.
+  std::array<double, 4> levelRates = {{1.0, 1.0, 1.0, 1.0}};
+
+  // Limit for each call site logged through the VIGILANT_* macros, in
+  // records per second, allowing bursts of up to callsiteBurst records.
+  // Zero disables the limit.
+  double callsiteRate = 0.0;
+  double callsiteBurst = 10.0;
+
+  // How often the number of suppressed records is reported as a record of
+  // its own.
+  std::chrono::milliseconds reportInterval = std::chrono::seconds(10);
+};
+
+// Decides whether a record is logged at all. Checked by the Logger before the
+// record is built, so a suppressed call costs a random number and an atomic
+// increment.
+class Sampler
+{
+public:
+  explicit Sampler(const SamplingOptions &options);
+
+  Sampler(const Sampler &) = delete;
+  Sampler &operator=(const Sampler &) = delete;
+
+  bool enabled() const { return enabled_; }
+  std::chrono::milliseconds reportInterval() const { return reportInterval_; }
+
+  bool admit(LogLevel level, Callsite *site)
+  {
+    if (!enabled_)
+    {
+      return true;
+    }
+    size_t index = static_cast<size_t>(level);
+    if ((thresholds_[index] != kAlways && nextRandom() >= thresholds_[index]) ||
+        (site != nullptr && interval_ > 0 && !takeToken(*site)))
+    {
+      suppressed_[index].fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    return true;
+  }
+
+  // Returns the number of records suppressed at each level since the last
+  // call.
+  std::array<uint64_t, 4> takeSuppressed();
+
+private:
+  static constexpr uint64_t kAlways = UINT64_MAX;
+
+  bool enabled_;
+  std::array<uint64_t, 4> thresholds_;
+  int64_t interval_;
+  int64_t tolerance_;
+  std::chrono::milliseconds reportInterval_;
+  std::array<std::atomic<uint64_t>, 4> suppressed_;
+
+  bool takeToken(Callsite &site);
+  static uint64_t nextRandom();
+};
+
+#endif // SAMPLER_H
@@ -0,0 +1,540 @@
+#include <string>
+#include <vector>
+#include <mutex>
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <curl/curl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "sink.h"
+#include "transport.h"
+
+namespace
+{
+  const std::chrono::milliseconds kMinReconnectBackoff(100);
+  const std::chrono::milliseconds kMaxReconnectBackoff(30000);
+}
+
+HttpTimeouts HttpTimeouts::forBatchInterval(std::chrono::milliseconds batchInterval)
+{
+  using std::chrono::milliseconds;
+  using std::chrono::seconds;
+
+  HttpTimeouts timeouts;
+  timeouts.connect = std::min(std::max(batchInterval * 20, milliseconds(1000)), milliseconds(10000));
+  timeouts.request = std::min(std::max(batchInterval * 100, milliseconds(5000)), milliseconds(60000));
+  timeouts.lowSpeedLimit = 1024;
+  timeouts.lowSpeedTime = std::max(std::chrono::duration_cast<seconds>(timeouts.request / 2), seconds(1));
+  return timeouts;
+}
+
+HttpSink::HttpSink(const std::string &url, const HttpTimeouts &timeouts)
+    : url_(url),
+      timeouts_(timeouts),
+      context_(),
+      curl_(nullptr),
+      headers_(nullptr),
+      cancelled_(false)
+{
+}
+
+bool HttpSink::ensureHandle()
+{
+  if (curl_)
+  {
+    return true;
+  }
+
+  context_ = TransportContext::acquire();
+  if (!headers_)
+  {
+    headers_ = curl_slist_append(headers_, "Content-Type: application/json");
+  }
+  curl_ = curl_easy_init();
+  if (curl_)
+  {
+    curl_easy_setopt(curl_, CURLOPT_URL, url_.c_str());
+    curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, headers_);
+    curl_easy_setopt(curl_, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl_, CURLOPT_CONNECTTIMEOUT_MS, (long)timeouts_.connect.count());
+    curl_easy_setopt(curl_, CURLOPT_TIMEOUT_MS, (long)timeouts_.request.count());
+    curl_easy_setopt(curl_, CURLOPT_LOW_SPEED_LIMIT, timeouts_.lowSpeedLimit);
+    curl_easy_setopt(curl_, CURLOPT_LOW_SPEED_TIME, (long)timeouts_.lowSpeedTime.count());
+    curl_easy_setopt(curl_, CURLOPT_XFERINFOFUNCTION, &HttpSink::onProgress);
+    curl_easy_setopt(curl_, CURLOPT_XFERINFODATA, this);
+    curl_easy_setopt(curl_, CURLOPT_NOPROGRESS, 0L);
+    if (context_->share())
+    {
+      curl_easy_setopt(curl_, CURLOPT_SHARE, context_->share());
+    }
+  }
+  return curl_ != nullptr;
+}
+
+HttpSink::~HttpSink()
+{
+  if (curl_)
+  {
+    curl_easy_cleanup(curl_);
+  }
+  curl_slist_free_all(headers_);
+}
+
+bool HttpSink::send(const std::string &payload)
+{
+  if (cancelled_ || !ensureHandle())
+  {
+    return false;
+  }
+
+  curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, payload.c_str());
+  curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, (long)payload.size());
+
+  CURLcode res = curl_easy_perform(curl_);
+  if (res != CURLE_OK)
+  {
+    std::cerr << "Failed to send logs: " << curl_easy_strerror(res) << std::endl;
+    return false;
+  }
+
+  // Only a 2xx response means the payload was accepted.
+  long status = 0;
+  curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &status);
+  if (status < 200 || status >= 300)
+  {
+    std::cerr << "Failed to send logs: HTTP status " << status << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void HttpSink::cancel()
+{
+  cancelled_ = true;
+}
+
+void HttpSink::resetAfterFork()
+{
+  // The inherited handle and share may reference the parent's sockets and
+  // TLS state and can't be cleaned up safely here, so they are leaked.
+  if (context_)
+  {
+    new std::shared_ptr<TransportContext>(std::move(context_));
+  }
+  curl_ = nullptr;
+  cancelled_ = false;
+}
+
+void HttpSink::prewarm()
+{
+  if (cancelled_ || !ensureHandle())
+  {
+    return;
+  }
+
+  // A HEAD request on the long-lived handle resolves the host, completes
+  // the TLS handshake and leaves the connection open in the handle's pool,
+  // so the first upload reuses it. Connect-only transfers can't be used for
+  // this: libcurl never hands their connections to later requests. The
+  // response status doesn't matter; the next send() sets POSTFIELDS, which
+  // turns the handle back into a POST.
+  curl_easy_setopt(curl_, CURLOPT_NOBODY, 1L);
+  CURLcode res = curl_easy_perform(curl_);
+  curl_easy_setopt(curl_, CURLOPT_NOBODY, 0L);
+  if (res != CURLE_OK)
+  {
+    std::cerr << "Failed to prewarm connection: " << curl_easy_strerror(res) << std::endl;
+  }
+}
+
+int HttpSink::onProgress(void *userptr, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+  // Called by libcurl about once a second and whenever data moves; a
+  // non-zero return aborts the transfer with CURLE_ABORTED_BY_CALLBACK.
+  auto *sink = static_cast<HttpSink *>(userptr);
+  return sink->cancelled_ ? 1 : 0;
+}
+
+FileSink::FileSink(const std::string &path)
+    : path_(path),
+      fd_(::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644))
+{
+  if (fd_ < 0)
+  {
+    std::cerr << "Failed to open log file " << path_ << ": " << std::strerror(errno) << std::endl;
+  }
+}
+
+FileSink::~FileSink()
+{
+  if (fd_ >= 0)
+  {
+    ::close(fd_);
+  }
+}
+
+bool FileSink::send(const std::string &payload)
+{
+  if (fd_ < 0)
+  {
+    return false;
+  }
+
+  // A single O_APPEND writev keeps each line contiguous even if several
+  // processes share the file.
+  char newline = '\n';
+  struct iovec iov[2];
+  iov[0].iov_base = const_cast<char *>(payload.data());
+  iov[0].iov_len = payload.size();
+  iov[1].iov_base = &newline;
+  iov[1].iov_len = 1;
+
+  size_t expected = payload.size() + 1;
+  ssize_t n;
+  do
+  {
+    n = ::writev(fd_, iov, 2);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0 || static_cast<size_t>(n) != expected)
+  {
+    std::cerr << "Failed to write logs to " << path_ << std::endl;
+    return false;
+  }
+  return true;
+}
+
+UdpSink::UdpSink(const std::string &host, uint16_t port)
+    : fd_(-1)
+{
+  struct addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  struct addrinfo *result = nullptr;
+  std::string service = std::to_string(port);
+  int rc = ::getaddrinfo(host.c_str(), service.c_str(), &hints, &result);
+  if (rc != 0)
+  {
+    std::cerr << "Failed to resolve " << host << ": " << gai_strerror(rc) << std::endl;
+    return;
+  }
+
+  for (struct addrinfo *ai = result; ai != nullptr; ai = ai->ai_next)
+  {
+    int fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+    {
+      fd_ = fd;
+      break;
+    }
+    ::close(fd);
+  }
+  ::freeaddrinfo(result);
+
+  if (fd_ < 0)
+  {
+    std::cerr << "Failed to open UDP socket to " << host << ":" << port << std::endl;
+  }
+}
+
+UdpSink::~UdpSink()
+{
+  if (fd_ >= 0)
+  {
+    ::close(fd_);
+  }
+}
+
+bool UdpSink::send(const std::string &payload)
+{
+  if (fd_ < 0)
+  {
+    return false;
+  }
+
+  ssize_t n;
+  do
+  {
+    n = ::send(fd_, payload.data(), payload.size(), MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+  {
+    std::cerr << "Failed to send logs: " << std::strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+UnixSocketSink::UnixSocketSink(const std::string &path, std::shared_ptr<Sink> fallback, const HttpTimeouts &timeouts)
+    : path_(path),
+      fallback_(std::move(fallback)),
+      timeouts_(timeouts),
+      fd_(-1),
+      cancelled_(false),
+      retryAt_(),
+      backoff_(kMinReconnectBackoff)
+{
+}
+
+UnixSocketSink::~UnixSocketSink()
+{
+  disconnect();
+}
+
+bool UnixSocketSink::send(const std::string &payload)
+{
+  if (cancelled_ || payload.size() > UINT32_MAX)
+  {
+    return sendFallback(payload);
+  }
+
+  // One reconnect attempt covers the common case of the agent restarting
+  // between batches; anything longer is handled by the backoff.
+  for (int attempt = 0; attempt < 2; ++attempt)
+  {
+    if (fd_ < 0 && !connect())
+    {
+      break;
+    }
+    if (sendFramed(payload))
+    {
+      return true;
+    }
+    // A stalled agent is not retried; the fallback takes the payload.
+    bool retry = errno != EMSGSIZE && errno != EAGAIN && errno != EWOULDBLOCK;
+    disconnect();
+    if (!retry || cancelled_)
+    {
+      break;
+    }
+  }
+
+  return sendFallback(payload);
+}
+
+void UnixSocketSink::cancel()
+{
+  cancelled_ = true;
+  {
+    // Wakes a send() blocked on a full socket buffer.
+    std::lock_guard<std::mutex> lock(fdMutex_);
+    if (fd_ >= 0)
+    {
+      ::shutdown(fd_, SHUT_RDWR);
+    }
+  }
+  if (fallback_)
+  {
+    fallback_->cancel();
+  }
+}
+
+void UnixSocketSink::resetAfterFork()
+{
+  // Another thread of the parent may have held fdMutex_ at fork time, and
+  // it is not taken in the prepare handler, so it is rebuilt rather than
+  // locked. Closing only drops the child's descriptor; the parent keeps its
+  // connection to the agent.
+  new (&fdMutex_) std::mutex();
+  if (fd_ >= 0)
+  {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  retryAt_ = std::chrono::steady_clock::time_point();
+  backoff_ = kMinReconnectBackoff;
+  cancelled_ = false;
+  if (fallback_)
+  {
+    fallback_->resetAfterFork();
+  }
+}
+
+void UnixSocketSink::prewarm()
+{
+  if (fd_ < 0 && !connect() && fallback_)
+  {
+    fallback_->prewarm();
+  }
+}
+
+bool UnixSocketSink::connect()
+{
+  auto now = std::chrono::steady_clock::now();
+  if (now < retryAt_)
+  {
+    return false;
+  }
+
+#ifdef SOCK_SEQPACKET
+  if (connectAs(SOCK_SEQPACKET))
+  {
+    backoff_ = kMinReconnectBackoff;
+    return true;
+  }
+#endif
+  if (connectAs(SOCK_STREAM))
+  {
+    backoff_ = kMinReconnectBackoff;
+    return true;
+  }
+
+  retryAt_ = now + backoff_;
+  backoff_ = std::min(backoff_ * 2, kMaxReconnectBackoff);
+  return false;
+}
+
+bool UnixSocketSink::connectAs(int type)
+{
+  struct sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  if (path_.size() >= sizeof(addr.sun_path))
+  {
+    return false;
+  }
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path_.c_str(), path_.size());
+
+  int fd = ::socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    return false;
+  }
+  if (::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)
+  {
+    ::close(fd);
+    return false;
+  }
+  if (timeouts_.request.count() > 0)
+  {
+    struct timeval timeout;
+    timeout.tv_sec = static_cast<time_t>(timeouts_.request.count() / 1000);
+    timeout.tv_usec = static_cast<suseconds_t>(timeouts_.request.count() % 1000 * 1000);
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  }
+  std::lock_guard<std::mutex> lock(fdMutex_);
+  fd_ = fd;
+  return true;
+}
+
+void UnixSocketSink::disconnect()
+{
+  std::lock_guard<std::mutex> lock(fdMutex_);
+  if (fd_ >= 0)
+  {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool UnixSocketSink::sendFramed(const std::string &payload)
+{
+  uint32_t size = static_cast<uint32_t>(payload.size());
+  unsigned char header[4] = {
+      static_cast<unsigned char>(size >> 24),
+      static_cast<unsigned char>(size >> 16),
+      static_cast<unsigned char>(size >> 8),
+      static_cast<unsigned char>(size)};
+
+  // Header and body go out in one sendmsg so that a SOCK_SEQPACKET peer
+  // receives them as a single record.
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = const_cast<char *>(payload.data());
+  iov[1].iov_len = payload.size();
+
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  // SO_SNDTIMEO bounds each call; the deadline bounds a peer that keeps
+  // draining a few bytes at a time.
+  auto deadline = std::chrono::steady_clock::now() + timeouts_.request;
+  while (msg.msg_iovlen > 0)
+  {
+    ssize_t n = ::sendmsg(fd_, &msg, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR && !cancelled_)
+        continue;
+      return false;
+    }
+
+    size_t sent = static_cast<size_t>(n);
+    while (msg.msg_iovlen > 0 && sent >= msg.msg_iov->iov_len)
+    {
+      sent -= msg.msg_iov->iov_len;
+      ++msg.msg_iov;
+      --msg.msg_iovlen;
+    }
+    if (msg.msg_iovlen > 0)
+    {
+      msg.msg_iov->iov_base = static_cast<char *>(msg.msg_iov->iov_base) + sent;
+      msg.msg_iov->iov_len -= sent;
+      if (timeouts_.request.count() > 0 && std::chrono::steady_clock::now() >= deadline)
+      {
+        errno = EAGAIN;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool UnixSocketSink::sendFallback(const std::string &payload)
+{
+  if (!fallback_)
+  {
+    std::cerr << "Failed to send logs to " << path_ << std::endl;
+    return false;
+  }
+  return fallback_->send(payload);
+}
+
+bool MemorySink::send(const std::string &payload)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  payloads_.push_back(payload);
+  return true;
+}
+
+void MemorySink::resetAfterFork()
+{
+  // Another thread of the parent may have held the mutex at fork time.
+  new (&mutex_) std::mutex();
+}
+
+std::vector<std::string> MemorySink::payloads() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return payloads_;
+}
+
+size_t MemorySink::size() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return payloads_.size();
+}
+
+void MemorySink::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  payloads_.clear();
+}
@@ -0,0 +1,178 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <curl/curl.h>
+
+class TransportContext;
+
+// A Sink receives fully encoded batches from the Logger's sender thread.
+// send() is only ever called from that one thread, so implementations do not
+// need to be thread-safe unless they are inspected from elsewhere.
+class Sink
+{
+public:
+  virtual ~Sink() = default;
+
+  // Returns false if the payload could not be delivered.
+  virtual bool send(const std::string &payload) = 0;
+
+  // Aborts an in-flight send() from another thread and makes later calls
+  // fail fast. Used when a shutdown deadline expires.
+  virtual void cancel() {}
+
+  // Called in the child after fork(). Connections inherited from the parent
+  // must not be written to by both processes, so sinks that hold one should
+  // drop it here and reconnect on the next send().
+  virtual void resetAfterFork() {}
+
+  // Called on the sender thread when the Logger is prewarmed, so that the
+  // first real send() does not pay for connection setup.
+  virtual void prewarm() {}
+};
+
+// Limits applied to each HTTP upload. A zero value disables that limit.
+struct HttpTimeouts
+{
+  std::chrono::milliseconds connect = std::chrono::milliseconds(0);
+  std::chrono::milliseconds request = std::chrono::milliseconds(0);
+  // Abort when the transfer stays below lowSpeedLimit bytes per second for
+  // lowSpeedTime.
+  long lowSpeedLimit = 0;
+  std::chrono::seconds lowSpeedTime = std::chrono::seconds(0);
+
+  // Defaults scaled to how often batches are sent, so a stalled upload is
+  // abandoned before many batches back up behind it.
+  static HttpTimeouts forBatchInterval(std::chrono::milliseconds batchInterval);
+};
+
+// POSTs each payload to an HTTP(S) endpoint. The easy handle is kept between
+// requests and attached to the process-wide TransportContext, so DNS lookups,
+// TLS sessions and connections are reused across batches and across Loggers.
+// libcurl is not initialized until the first send() or prewarm().
+class HttpSink : public Sink
+{
+public:
+  explicit HttpSink(const std::string &url,
+                    const HttpTimeouts &timeouts = HttpTimeouts::forBatchInterval(std::chrono::milliseconds(100)));
+  ~HttpSink() override;
+
+  HttpSink(const HttpSink &) = delete;
+  HttpSink &operator=(const HttpSink &) = delete;
+
+  bool send(const std::string &payload) override;
+  void cancel() override;
+  void resetAfterFork() override;
+  void prewarm() override;
+
+private:
+  std::string url_;
+  HttpTimeouts timeouts_;
+  std::shared_ptr<TransportContext> context_;
+  CURL *curl_;
+  struct curl_slist *headers_;
+  std::atomic<bool> cancelled_;
+
+  bool ensureHandle();
+  static int onProgress(void *userptr, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+};
+
+// Appends each payload as one line to a file.
+class FileSink : public Sink
+{
+public:
+  explicit FileSink(const std::string &path);
+  ~FileSink() override;
+
+  FileSink(const FileSink &) = delete;
+  FileSink &operator=(const FileSink &) = delete;
+
+  bool send(const std::string &payload) override;
+
+private:
+  std::string path_;
+  int fd_;
+};
+
+// Sends each payload as a single UDP datagram. Payloads larger than the
+// path MTU are fragmented by the kernel or rejected, so keep batches small.
+class UdpSink : public Sink
+{
+public:
+  UdpSink(const std::string &host, uint16_t port);
+  ~UdpSink() override;
+
+  UdpSink(const UdpSink &) = delete;
+  UdpSink &operator=(const UdpSink &) = delete;
+
+  bool send(const std::string &payload) override;
+
+private:
+  int fd_;
+};
+
+// Forwards payloads to a local agent over a persistent Unix domain socket.
+// Each payload is framed by a 4-byte big-endian length prefix. A
+// SOCK_SEQPACKET connection is preferred and SOCK_STREAM is used when the
+// peer or platform does not support it. While the agent is unreachable the
+// sink retries with exponential backoff and routes payloads to the optional
+// fallback sink instead. A send that makes no progress for timeouts.request,
+// such as to an agent that stopped reading, fails and drops the connection.
+class UnixSocketSink : public Sink
+{
+public:
+  explicit UnixSocketSink(const std::string &path,
+                          std::shared_ptr<Sink> fallback = nullptr,
+                          const HttpTimeouts &timeouts = HttpTimeouts::forBatchInterval(std::chrono::milliseconds(100)));
+  ~UnixSocketSink() override;
+
+  UnixSocketSink(const UnixSocketSink &) = delete;
+  UnixSocketSink &operator=(const UnixSocketSink &) = delete;
+
+  bool send(const std::string &payload) override;
+  void cancel() override;
+  void resetAfterFork() override;
+  void prewarm() override;
+
+private:
+  std::string path_;
+  std::shared_ptr<Sink> fallback_;
+  HttpTimeouts timeouts_;
+  // Guards fd_ against cancel(), which shuts the socket down from another
+  // thread while send() may be blocked on it.
+  std::mutex fdMutex_;
+  int fd_;
+  std::atomic<bool> cancelled_;
+  std::chrono::steady_clock::time_point retryAt_;
+  std::chrono::milliseconds backoff_;
+
+  bool connect();
+  bool connectAs(int type);
+  void disconnect();
+  bool sendFramed(const std::string &payload);
+  bool sendFallback(const std::string &payload);
+};
+
+// Keeps every payload in memory. Intended for tests and benchmarks.
+class MemorySink : public Sink
+{
+public:
+  bool send(const std::string &payload) override;
+  void resetAfterFork() override;
+
+  std::vector<std::string> payloads() const;
+  size_t size() const;
+  void clear();
+
+private:
+  mutable std::mutex mutex_;
+  std::vector<std::string> payloads_;
+};
+
+#endif // SINK_H
@@ -0,0 +1,100 @@
+#include <string>
+#include <vector>
+
+#include "span.h"
+#include "tracer.h"
+
+namespace
+{
+  thread_local Span *currentSpan = nullptr;
+}
+
+Span::Span(std::shared_ptr<SpanRing> ring, const std::string *service, std::string name, const std::vector<Attribute> &attrs)
+    : ring_(std::move(ring)),
+      service_(service),
+      parent_(nullptr),
+      parentSpanId_(0),
+      startTicks_(0),
+      name_(std::move(name))
+{
+  if (!ring_)
+  {
+    return;
+  }
+  parent_ = currentSpan;
+  if (parent_)
+  {
+    context_.traceIdHigh = parent_->context_.traceIdHigh;
+    context_.traceIdLow = parent_->context_.traceIdLow;
+    parentSpanId_ = parent_->context_.spanId;
+  }
+  else
+  {
+    context_.traceIdHigh = Tracer::randomId();
+    context_.traceIdLow = Tracer::randomId();
+  }
+  context_.spanId = Tracer::randomId();
+  if (!attrs.empty())
+  {
+    attributes_.reserve(attrs.size());
+    for (auto &attr : attrs)
+    {
+      attributes_.emplace_back(attr);
+    }
+  }
+  currentSpan = this;
+  startTicks_ = spanTicks();
+}
+
+Span::~Span()
+{
+  if (!ring_)
+  {
+    return;
+  }
+  uint64_t endTicks = spanTicks();
+  currentSpan = parent_;
+  ring_->push(SpanRecord{std::move(name_), context_, parentSpanId_, startTicks_, endTicks, service_, std::move(attributes_)});
+}
+
+void Span::setAttribute(const std::string &key, AttributeValue value)
+{
+  if (!ring_)
+  {
+    return;
+  }
+  for (auto &attr : attributes_)
+  {
+    if (attr.key() == key)
+    {
+      attr.value = std::move(value);
+      return;
+    }
+  }
+  attributes_.emplace_back(key, std::move(value));
+}
+
+const std::string &Span::traceIdHex() const
+{
+  if (traceIdHex_.empty())
+  {
+    traceIdHex_.reserve(32);
+    appendHexId(traceIdHex_, context_.traceIdHigh);
+    appendHexId(traceIdHex_, context_.traceIdLow);
+  }
+  return traceIdHex_;
+}
+
+const std::string &Span::spanIdHex() const
+{
+  if (spanIdHex_.empty())
+  {
+    appendHexId(spanIdHex_, context_.spanId);
+  }
+  return spanIdHex_;
+}
+
+Span *Span::current()
+{
+  return currentSpan;
+}
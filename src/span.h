@@ -0,0 +1,99 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "log_message.h"
+
+struct SpanRing;
+
+// Reads the clock used for span boundaries: the time-stamp counter on x86,
+// which costs a few nanoseconds, and steady_clock elsewhere. Ticks are
+// converted to wall-clock time on the batcher thread, against a calibration
+// taken when the Exporter was created. Assumes an invariant TSC, as on any
+// x86 CPU from the last decade.
+inline uint64_t spanTicks()
+{
+#if (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))) || defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now().time_since_epoch())
+                                   .count());
+#endif
+}
+
+struct SpanContext
+{
+  uint64_t traceIdHigh = 0;
+  uint64_t traceIdLow = 0;
+  uint64_t spanId = 0;
+};
+
+// Times a unit of work from construction to destruction. Created by
+// Logger::startSpan. While a span is alive it is the current span of its
+// thread: spans started inside it become its children, and records logged
+// on the thread carry its trace_id and span_id. Finished spans are handed to
+// the Exporter through a per-thread ring and sent by the batcher as
+// "traces" payloads.
+//
+// Spans must end on the thread that started them, in reverse order of
+// creation. A span that ends after its Exporter is gone is dropped.
+// Starting one only allocates if it has attributes or a name too long for
+// the small-string buffer.
+class Span
+{
+public:
+  ~Span();
+
+  Span(const Span &) = delete;
+  Span &operator=(const Span &) = delete;
+
+  void setAttribute(const std::string &key, AttributeValue value);
+
+  const SpanContext &context() const { return context_; }
+
+  // The ids as lowercase hex, as written to records and payloads.
+  const std::string &traceIdHex() const;
+  const std::string &spanIdHex() const;
+
+  // The innermost live span on this thread, or nullptr.
+  static Span *current();
+
+private:
+  friend class Logger;
+
+  Span(std::shared_ptr<SpanRing> ring, const std::string *service, std::string name, const std::vector<Attribute> &attrs);
+
+  // This thread's ring for the Exporter; null for a noop span.
+  std::shared_ptr<SpanRing> ring_;
+  const std::string *service_;
+  Span *parent_;
+  SpanContext context_;
+  uint64_t parentSpanId_;
+  uint64_t startTicks_;
+  std::string name_;
+  std::vector<KeyValue> attributes_;
+  mutable std::string traceIdHex_;
+  mutable std::string spanIdHex_;
+};
+
+// Has the same interface as Span but does nothing; returned by NullLogger.
+class NullSpan
+{
+public:
+  template <typename K, typename V>
+  void setAttribute(K &&, V &&) {}
+};
+
+#endif // SPAN_H
@@ -0,0 +1,286 @@
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#include "tracer.h"
+#include "json_writer.h"
+
+namespace
+{
+  const char kHexDigits[] = "0123456789abcdef";
+
+  std::atomic<uint64_t> nextTracerId(1);
+
+  // Ticks are compared against steady_clock over at least this long before
+  // the first conversion, so that the rate is known to a few ppm.
+  const std::chrono::milliseconds kMinCalibration(20);
+
+  void appendNanos(std::string &out, int64_t nanos)
+  {
+    appendJsonValue(out, AttributeValue(nanos));
+  }
+}
+
+void appendHexId(std::string &out, uint64_t value)
+{
+  char buffer[16];
+  for (int i = 15; i >= 0; --i)
+  {
+    buffer[i] = kHexDigits[value & 0xF];
+    value >>= 4;
+  }
+  out.append(buffer, sizeof(buffer));
+}
+
+// The rings this thread produces into, one per Tracer it has ended spans
+// for. Rings are marked orphaned when the thread exits.
+struct Tracer::ThreadRings
+{
+  struct Entry
+  {
+    uint64_t owner;
+    std::shared_ptr<SpanRing> ring;
+  };
+  std::vector<Entry> entries;
+
+  ~ThreadRings()
+  {
+    for (auto &entry : entries)
+    {
+      entry.ring->orphaned.store(true, std::memory_order_release);
+    }
+  }
+};
+
+Tracer::Tracer()
+    : id_(nextTracerId.fetch_add(1, std::memory_order_relaxed)),
+      active_(false),
+      dropped_(0),
+      anchorTicks_(spanTicks()),
+      anchorSteady_(std::chrono::steady_clock::now()),
+      anchorUnixNanos_(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::system_clock::now().time_since_epoch())
+                           .count()),
+      nanosPerTick_(1.0)
+{
+}
+
+Tracer::~Tracer() = default;
+
+uint64_t Tracer::randomId()
+{
+  // splitmix64 over a per-thread counter. Ids must not collide across
+  // processes either, so the seed mixes in the random device.
+  static thread_local uint64_t state =
+      (static_cast<uint64_t>(std::random_device()()) << 32) ^
+      std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+      static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+  uint64_t z;
+  do
+  {
+    z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+  } while (z == 0);
+  return z;
+}
+
+std::shared_ptr<SpanRing> Tracer::ringForThisThread()
+{
+  static thread_local ThreadRings local;
+  for (auto &entry : local.entries)
+  {
+    if (entry.owner == id_)
+    {
+      return entry.ring;
+    }
+  }
+
+  // Forget rings whose Tracer has been destroyed.
+  local.entries.erase(std::remove_if(local.entries.begin(), local.entries.end(),
+                                     [](const ThreadRings::Entry &entry)
+                                     { return entry.ring.use_count() == 1; }),
+                      local.entries.end());
+
+  std::shared_ptr<SpanRing> ring;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &slot = rings_[std::this_thread::get_id()];
+    if (!slot)
+    {
+      slot = std::make_shared<SpanRing>();
+    }
+    // A new thread can inherit the id, and the ring, of one that exited.
+    slot->orphaned.store(false, std::memory_order_relaxed);
+    ring = slot;
+  }
+  local.entries.push_back({id_, ring});
+  active_.store(true, std::memory_order_relaxed);
+  return ring;
+}
+
+const std::string *Tracer::internService(const std::string &name)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return &*services_.insert(name).first;
+}
+
+void SpanRing::push(SpanRecord &&record)
+{
+  size_t current = head.load(std::memory_order_relaxed);
+  if (current - tail.load(std::memory_order_acquire) == kCapacity)
+  {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  slots[current % kCapacity] = std::move(record);
+  head.store(current + 1, std::memory_order_release);
+}
+
+void Tracer::calibrate()
+{
+  auto elapsed = std::chrono::steady_clock::now() - anchorSteady_;
+  if (elapsed < kMinCalibration)
+  {
+    std::this_thread::sleep_for(kMinCalibration - elapsed);
+  }
+  uint64_t ticks = spanTicks();
+  elapsed = std::chrono::steady_clock::now() - anchorSteady_;
+  if (ticks > anchorTicks_)
+  {
+    nanosPerTick_ = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) /
+                    static_cast<double>(ticks - anchorTicks_);
+  }
+}
+
+int64_t Tracer::toUnixNanos(uint64_t ticks) const
+{
+  auto delta = static_cast<double>(static_cast<int64_t>(ticks - anchorTicks_));
+  return anchorUnixNanos_ + static_cast<int64_t>(delta * nanosPerTick_);
+}
+
+size_t Tracer::collect(std::string &out)
+{
+  // Calibration may sleep, and threads registering their first span must
+  // not wait for it.
+  if (!active())
+  {
+    return 0;
+  }
+  calibrate();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t written = 0;
+  for (auto it = rings_.begin(); it != rings_.end();)
+  {
+    SpanRing &ring = *it->second;
+    dropped_.fetch_add(ring.dropped.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+    // Read orphaned first: once it is set the owner will not push again.
+    bool orphaned = ring.orphaned.load(std::memory_order_acquire);
+    size_t tail = ring.tail.load(std::memory_order_relaxed);
+    size_t head = ring.head.load(std::memory_order_acquire);
+    for (; tail != head; ++tail)
+    {
+      SpanRecord record = std::move(ring.slots[tail % SpanRing::kCapacity]);
+      if (written++ > 0)
+      {
+        out.push_back(',');
+      }
+      out.append("{\"name\":");
+      appendJsonString(out, record.name);
+      out.append(",\"trace_id\":\"");
+      appendHexId(out, record.context.traceIdHigh);
+      appendHexId(out, record.context.traceIdLow);
+      out.append("\",\"span_id\":\"");
+      appendHexId(out, record.context.spanId);
+      out.push_back('"');
+      if (record.parentSpanId != 0)
+      {
+        out.append(",\"parent_span_id\":\"");
+        appendHexId(out, record.parentSpanId);
+        out.push_back('"');
+      }
+      out.append(",\"start_time_unix_nano\":");
+      appendNanos(out, toUnixNanos(record.startTicks));
+      out.append(",\"end_time_unix_nano\":");
+      appendNanos(out, toUnixNanos(record.endTicks));
+      out.append(",\"attributes\":{");
+      bool first = true;
+      // A "service.name" set on the span itself wins.
+      if (record.service && std::none_of(record.attributes.begin(), record.attributes.end(),
+                                         [](const KeyValue &attr)
+                                         { return attr.key() == "service.name"; }))
+      {
+        out.append("\"service.name\":");
+        appendJsonString(out, *record.service);
+        first = false;
+      }
+      for (auto &attr : record.attributes)
+      {
+        if (!first)
+        {
+          out.push_back(',');
+        }
+        appendJsonMember(out, attr.key(), attr.value);
+        first = false;
+      }
+      out.append("}}");
+    }
+    ring.tail.store(tail, std::memory_order_release);
+
+    if (orphaned)
+    {
+      it = rings_.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+  return written;
+}
+
+void Tracer::lockForFork()
+{
+  mutex_.lock();
+}
+
+void Tracer::unlockForFork()
+{
+  mutex_.unlock();
+}
+
+void Tracer::resetInChild()
+{
+  // Only the forking thread survives, and the spans already finished belong
+  // to the parent.
+  auto self = std::this_thread::get_id();
+  for (auto it = rings_.begin(); it != rings_.end();)
+  {
+    SpanRing &ring = *it->second;
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    for (size_t tail = ring.tail.load(std::memory_order_relaxed); tail != head; ++tail)
+    {
+      ring.slots[tail % SpanRing::kCapacity] = SpanRecord();
+    }
+    ring.tail.store(head, std::memory_order_relaxed);
+    ring.dropped.store(0, std::memory_order_relaxed);
+    if (it->first == self)
+    {
+      ++it;
+    }
+    else
+    {
+      it = rings_.erase(it);
+    }
+  }
+  dropped_ = 0;
+  mutex_.unlock();
+}
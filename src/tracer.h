@@ -0,0 +1,113 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+#include "log_message.h"
+#include "span.h"
+
+// A finished span, as queued for export.
+struct SpanRecord
+{
+  std::string name;
+  SpanContext context;
+  uint64_t parentSpanId = 0;
+  uint64_t startTicks = 0;
+  uint64_t endTicks = 0;
+  // Interned by Tracer::internService; written as "service.name".
+  const std::string *service = nullptr;
+  std::vector<KeyValue> attributes;
+};
+
+// The spans one thread has finished for one Tracer. The thread pushes and
+// the batcher drains, so push() is a move into a slot and a release store.
+// Live spans hold their ring rather than the Exporter: a span that ends
+// after its Exporter is gone lands in a ring nobody drains.
+struct SpanRing
+{
+  static constexpr size_t kCapacity = 1024;
+
+  std::atomic<size_t> head{0};
+  std::atomic<size_t> tail{0};
+  // Set when the owning thread exits; the ring is dropped once drained.
+  std::atomic<bool> orphaned{false};
+  // Spans pushed onto a full ring, which are dropped.
+  std::atomic<uint64_t> dropped{0};
+  SpanRecord slots[kCapacity];
+
+  void push(SpanRecord &&record);
+};
+
+// Appends value as 16 lowercase hex digits.
+void appendHexId(std::string &out, uint64_t value);
+
+// Collects finished spans for one Exporter. Each thread that starts a span
+// gets its own SpanRing; the batcher drains every ring in collect().
+class Tracer
+{
+public:
+  Tracer();
+  ~Tracer();
+
+  Tracer(const Tracer &) = delete;
+  Tracer &operator=(const Tracer &) = delete;
+
+  // The calling thread's ring, registered on first use. Later calls only
+  // search a short thread-local list.
+  std::shared_ptr<SpanRing> ringForThisThread();
+
+  // A pointer to a copy of name that lives as long as the Tracer, so that
+  // spans can refer to their service without copying it.
+  const std::string *internService(const std::string &name);
+
+  // True once any thread has started a span.
+  bool active() const { return active_.load(std::memory_order_relaxed); }
+
+  // Drains every ring and appends the spans to out as comma-separated JSON
+  // objects. Returns the number written.
+  size_t collect(std::string &out);
+
+  // Returns the number of spans dropped on full rings up to the last
+  // collect() since the previous call.
+  uint64_t takeDropped() { return dropped_.exchange(0, std::memory_order_relaxed); }
+
+  // fork() support: the ring registry lock is held across fork(), and the
+  // child discards the parent's spans.
+  void lockForFork();
+  void unlockForFork();
+  void resetInChild();
+
+  // A random non-zero id.
+  static uint64_t randomId();
+
+private:
+  struct ThreadRings;
+
+  uint64_t id_;
+  std::mutex mutex_;
+  std::map<std::thread::id, std::shared_ptr<SpanRing>> rings_;
+  std::set<std::string> services_;
+  std::atomic<bool> active_;
+  std::atomic<uint64_t> dropped_;
+
+  // Conversion from ticks to Unix time, recalibrated on every collect().
+  // Only the batcher touches these, so they need no lock.
+  uint64_t anchorTicks_;
+  std::chrono::steady_clock::time_point anchorSteady_;
+  int64_t anchorUnixNanos_;
+  double nanosPerTick_;
+
+  void calibrate();
+  int64_t toUnixNanos(uint64_t ticks) const;
+};
+
+#endif // TRACER_H
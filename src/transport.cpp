@@ -0,0 +1,82 @@
+#include <memory>
+#include <mutex>
+#include <curl/curl.h>
+
+#include "transport.h"
+
+namespace
+{
+  std::mutex contextMutex;
+  std::weak_ptr<TransportContext> currentContext;
+}
+
+std::shared_ptr<TransportContext> TransportContext::acquire()
+{
+  std::lock_guard<std::mutex> lock(contextMutex);
+  std::shared_ptr<TransportContext> context = currentContext.lock();
+  if (!context)
+  {
+    context.reset(new TransportContext());
+    currentContext = context;
+  }
+  return context;
+}
+
+void TransportContext::lockForFork()
+{
+  contextMutex.lock();
+}
+
+void TransportContext::unlockForFork()
+{
+  contextMutex.unlock();
+}
+
+void TransportContext::forgetInChild()
+{
+  currentContext.reset();
+  contextMutex.unlock();
+}
+
+TransportContext::TransportContext()
+    : share_(nullptr)
+{
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+
+  share_ = curl_share_init();
+  if (share_)
+  {
+    curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, &TransportContext::lock);
+    curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, &TransportContext::unlock);
+    curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+  }
+}
+
+TransportContext::~TransportContext()
+{
+  // curl_global_init and curl_global_cleanup are not thread-safe, so keep
+  // this serialized with acquire().
+  std::lock_guard<std::mutex> lock(contextMutex);
+  if (share_)
+  {
+    curl_share_cleanup(share_);
+  }
+  curl_global_cleanup();
+}
+
+void TransportContext::lock(CURL *, curl_lock_data data, curl_lock_access, void *userptr)
+{
+  auto *context = static_cast<TransportContext *>(userptr);
+  context->locks_[data].lock();
+}
+
+void TransportContext::unlock(CURL *, curl_lock_data data, void *userptr)
+{
+  auto *context = static_cast<TransportContext *>(userptr);
+  context->locks_[data].unlock();
+}
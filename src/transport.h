@@ -0,0 +1,42 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <memory>
+#include <mutex>
+#include <curl/curl.h>
+
+// Process-wide libcurl state shared by every HttpSink. The first acquire()
+// runs curl_global_init and the last released reference runs
+// curl_global_cleanup, so Loggers can be created and shut down in any order.
+// The share handle lets all easy handles reuse one DNS cache, TLS session
+// cache and connection pool.
+class TransportContext
+{
+public:
+  static std::shared_ptr<TransportContext> acquire();
+
+  ~TransportContext();
+
+  TransportContext(const TransportContext &) = delete;
+  TransportContext &operator=(const TransportContext &) = delete;
+
+  CURLSH *share() const { return share_; }
+
+  // fork() support. The child must not reuse the parent's connections or a
+  // share handle whose locks another thread may have held at fork time, so
+  // after forgetInChild() the next acquire() builds a fresh context.
+  static void lockForFork();
+  static void unlockForFork();
+  static void forgetInChild();
+
+private:
+  TransportContext();
+
+  CURLSH *share_;
+  std::mutex locks_[CURL_LOCK_DATA_LAST];
+
+  static void lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr);
+  static void unlock(CURL *handle, curl_lock_data data, void *userptr);
+};
+
+#endif // TRANSPORT_H
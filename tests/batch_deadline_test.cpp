@@ -0,0 +1,110 @@
+// Checks that a steady trickle of records is delivered within batchInterval
+// of each record being enqueued, using a manually advanced clock. Before
+// deadlines were taken from the oldest queued record, every arrival pushed
+// the send back and a trickle faster than batchInterval was never sent.
+
+#include <string>
+#include <vector>
+#include <set>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <iostream>
+
+#include "exporter.h"
+#include "sink.h"
+#include "test_support.h"
+
+namespace
+{
+  const std::chrono::milliseconds kBatchInterval(100);
+  const std::chrono::milliseconds kStep(20);
+  const int kRecords = 50;
+
+  // Indices of the records found in the sink's payloads so far.
+  std::set<int> delivered(const MemorySink &sink)
+  {
+    std::set<int> found;
+    for (auto &payload : sink.payloads())
+    {
+      size_t at = 0;
+      while ((at = payload.find("\"body\":\"r", at)) != std::string::npos)
+      {
+        at += 9;
+        found.insert(std::stoi(payload.substr(at)));
+      }
+    }
+    return found;
+  }
+
+  // Waits, in real time, for the batcher and sender to catch up with the
+  // manual clock.
+  bool waitForDelivered(const MemorySink &sink, int upTo)
+  {
+    auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (std::chrono::steady_clock::now() < giveUp)
+    {
+      auto found = delivered(sink);
+      bool all = true;
+      for (int i = 0; i <= upTo && all; ++i)
+      {
+        all = found.count(i) > 0;
+      }
+      if (all)
+      {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+  }
+}
+
+int main()
+{
+  auto sink = std::make_shared<MemorySink>();
+  ExporterOptions options;
+  options.token = "test";
+  options.sink = sink;
+  options.maxBatchSize = 1000;
+  options.batchInterval = kBatchInterval;
+  options.clock = &test::manualNow;
+  Exporter exporter(options);
+
+  // Record i is enqueued at i * kStep. Each enqueue wakes the batcher, so
+  // by the time record i is in, every record enqueued at least
+  // batchInterval earlier must have been sent.
+  int failures = 0;
+  for (int i = 0; i < kRecords; ++i)
+  {
+    if (i > 0)
+    {
+      test::advance(kStep);
+    }
+    LogMessage message;
+    message.timestamp = std::chrono::system_clock::now();
+    message.body = "r" + std::to_string(i);
+    message.level = LogLevel::Info;
+    exporter.enqueue(std::move(message));
+
+    int due = i - static_cast<int>(kBatchInterval / kStep);
+    if (due >= 0 && !waitForDelivered(*sink, due))
+    {
+      std::cerr << "record " << due << " not delivered within " << kBatchInterval.count()
+                << "ms of being enqueued" << std::endl;
+      ++failures;
+    }
+  }
+
+  if (exporter.shutdown(std::chrono::seconds(5)) != 0)
+  {
+    std::cerr << "records lost at shutdown" << std::endl;
+    ++failures;
+  }
+  if (delivered(*sink).size() != static_cast<size_t>(kRecords))
+  {
+    std::cerr << "expected " << kRecords << " records, got " << delivered(*sink).size() << std::endl;
+    ++failures;
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+// Checks that records still queued when a process dies from a fatal signal
+// are written to the crash log by the signal handler, and that the next
+// Exporter created with the same path uploads them, in the order they were
+// logged, before anything else.
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <iostream>
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "exporter.h"
+#include "sink.h"
+#include "test_support.h"
+
+namespace
+{
+  const int kRecords = 3;
+
+  ExporterOptions options(const std::shared_ptr<MemorySink> &sink, const std::string &path)
+  {
+    ExporterOptions options;
+    options.token = "test";
+    options.sink = sink;
+    options.crashLogPath = path;
+    options.clock = &test::manualNow;
+    return options;
+  }
+
+  LogMessage record(const std::string &body)
+  {
+    LogMessage message;
+    message.timestamp = std::chrono::system_clock::now();
+    message.body = body;
+    message.level = LogLevel::Error;
+    return message;
+  }
+
+  // Logs kRecords records that the manual clock keeps queued, then crashes.
+  void crash(const std::string &path)
+  {
+    struct rlimit noCore = {0, 0};
+    setrlimit(RLIMIT_CORE, &noCore);
+
+    auto sink = std::make_shared<MemorySink>();
+    Exporter exporter(options(sink, path));
+    for (int i = 0; i < kRecords; ++i)
+    {
+      exporter.enqueue(record("r" + std::to_string(i)));
+    }
+    raise(SIGSEGV);
+    _exit(0);
+  }
+}
+
+int main()
+{
+  std::string path = "/tmp/vigilant-crash-test-" + std::to_string(getpid()) + ".log";
+  std::remove(path.c_str());
+
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    std::cerr << "fork failed" << std::endl;
+    return 1;
+  }
+  if (pid == 0)
+  {
+    crash(path);
+  }
+
+  int failures = 0;
+  int status = 0;
+  if (waitpid(pid, &status, 0) != pid || !WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV)
+  {
+    std::cerr << "child did not die from SIGSEGV" << std::endl;
+    ++failures;
+  }
+
+  auto sink = std::make_shared<MemorySink>();
+  {
+    Exporter exporter(options(sink, path));
+    bool replayed = test::waitFor([&]()
+                                  { return test::countPayloads(*sink, "logs") > 0; });
+    if (!replayed)
+    {
+      std::cerr << "crash log not replayed" << std::endl;
+      ++failures;
+    }
+    else
+    {
+      std::string payload = sink->payloads().front();
+      size_t previous = 0;
+      for (int i = 0; i < kRecords; ++i)
+      {
+        size_t at = payload.find("\"body\":\"r" + std::to_string(i) + "\"");
+        if (at == std::string::npos || at < previous)
+        {
+          std::cerr << "record r" << i << " missing or out of order" << std::endl;
+          ++failures;
+          break;
+        }
+        previous = at;
+      }
+    }
+    exporter.shutdown();
+  }
+
+  // The replayed lines are consumed; a later start uploads nothing.
+  sink->clear();
+  {
+    Exporter exporter(options(sink, path));
+    exporter.shutdown();
+  }
+  if (sink->size() != 0)
+  {
+    std::cerr << "crash log replayed twice" << std::endl;
+    ++failures;
+  }
+
+  std::remove(path.c_str());
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,86 @@
+// Checks that identical records within the dedup window are collapsed: the
+// first one is sent as usual, the repeats become one summary record with
+// repeat_count, first_seen and last_seen once the window closes, and a
+// record that differs is never absorbed.
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <iostream>
+
+#include "exporter.h"
+#include "sink.h"
+#include "test_support.h"
+
+namespace
+{
+  const std::chrono::milliseconds kInterval(100);
+  const std::chrono::milliseconds kWindow(1000);
+  const int kRepeats = 4;
+
+  LogMessage record(const std::string &body)
+  {
+    LogMessage message;
+    message.timestamp = std::chrono::system_clock::now();
+    message.body = body;
+    message.level = LogLevel::Warn;
+    return message;
+  }
+}
+
+int main()
+{
+  auto sink = std::make_shared<MemorySink>();
+  ExporterOptions options;
+  options.token = "test";
+  options.sink = sink;
+  options.batchInterval = kInterval;
+  options.dedupWindow = kWindow;
+  options.clock = &test::manualNow;
+  Exporter exporter(options);
+
+  for (int i = 0; i <= kRepeats; ++i)
+  {
+    exporter.enqueue(record("storm"));
+  }
+  exporter.enqueue(record("other"));
+
+  int failures = 0;
+  // The first occurrence goes out with the next batch.
+  bool first = test::waitFor([&]()
+                             {
+                               test::advance(kInterval);
+                               return test::countOccurrences(*sink, "\"body\":\"storm\"") > 0; });
+  if (!first || test::countOccurrences(*sink, "\"repeat_count\"") != 0)
+  {
+    std::cerr << "first occurrence not sent on its own" << std::endl;
+    ++failures;
+  }
+  if (test::countOccurrences(*sink, "\"body\":\"other\"") != 1)
+  {
+    std::cerr << "distinct record absorbed" << std::endl;
+    ++failures;
+  }
+
+  // The repeats are summarized once the window has closed.
+  std::string summary = "\"repeat_count\":" + std::to_string(kRepeats);
+  bool summarized = test::waitFor([&]()
+                                  {
+                                    test::advance(kInterval);
+                                    return test::countOccurrences(*sink, summary) > 0; });
+  exporter.shutdown();
+  if (!summarized)
+  {
+    std::cerr << "no summary with " << summary << std::endl;
+    ++failures;
+  }
+  if (test::countOccurrences(*sink, "\"body\":\"storm\"") != 2 ||
+      test::countOccurrences(*sink, "\"repeat_count\"") != 1 ||
+      test::countOccurrences(*sink, "\"first_seen\"") != 1 ||
+      test::countOccurrences(*sink, "\"last_seen\"") != 1)
+  {
+    std::cerr << "expected the first occurrence and exactly one summary" << std::endl;
+    ++failures;
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+// Checks that an Exporter keeps working in the child after fork(): the
+// child's records are delivered by restarted batcher and sender threads that
+// carry the configured names, while the records the parent still had queued
+// are left to the parent and delivered exactly once, by the parent.
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "exporter.h"
+#include "sink.h"
+#include "test_support.h"
+
+namespace
+{
+  const std::chrono::milliseconds kInterval(100);
+
+  LogMessage record(const std::string &body)
+  {
+    LogMessage message;
+    message.timestamp = std::chrono::system_clock::now();
+    message.body = body;
+    message.level = LogLevel::Info;
+    return message;
+  }
+
+  // Whether a thread of this process is called name.
+  bool hasThread(const std::string &name)
+  {
+    DIR *dir = opendir("/proc/self/task");
+    if (dir == nullptr)
+    {
+      return false;
+    }
+    bool found = false;
+    while (dirent *entry = readdir(dir))
+    {
+      std::ifstream comm(std::string("/proc/self/task/") + entry->d_name + "/comm");
+      std::string line;
+      if (std::getline(comm, line) && line == name)
+      {
+        found = true;
+        break;
+      }
+    }
+    closedir(dir);
+    return found;
+  }
+
+  // Runs in the child; the exit code is the number of failed checks.
+  int child(Exporter &exporter, const MemorySink &sink)
+  {
+    int failures = 0;
+    exporter.enqueue(record("child"));
+    if (exporter.flush(std::chrono::seconds(5)) != 0)
+    {
+      std::cerr << "child: record not delivered" << std::endl;
+      ++failures;
+    }
+    if (test::countOccurrences(sink, "\"body\":\"child\"") != 1)
+    {
+      std::cerr << "child: expected its record once" << std::endl;
+      ++failures;
+    }
+    if (test::countOccurrences(sink, "\"body\":\"parent\"") != 0)
+    {
+      std::cerr << "child: sent the parent's queued record" << std::endl;
+      ++failures;
+    }
+    if (!hasThread("vgtest-batch") || !hasThread("vgtest-send"))
+    {
+      std::cerr << "child: worker threads not restarted under their names" << std::endl;
+      ++failures;
+    }
+    exporter.shutdown(std::chrono::seconds(5));
+    return failures;
+  }
+}
+
+int main()
+{
+  auto sink = std::make_shared<MemorySink>();
+  ExporterOptions options;
+  options.token = "test";
+  options.sink = sink;
+  options.batchInterval = kInterval;
+  options.clock = &test::manualNow;
+  options.workerName = "vgtest";
+  Exporter exporter(options);
+
+  // The manual clock does not move, so this stays queued across the fork.
+  exporter.enqueue(record("parent"));
+
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    std::cerr << "fork failed" << std::endl;
+    return 1;
+  }
+  if (pid == 0)
+  {
+    _exit(child(exporter, *sink));
+  }
+
+  int failures = 0;
+  int status = 0;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    std::cerr << "parent: child failed" << std::endl;
+    ++failures;
+  }
+  if (exporter.flush(std::chrono::seconds(5)) != 0)
+  {
+    std::cerr << "parent: record not delivered" << std::endl;
+    ++failures;
+  }
+  if (test::countOccurrences(*sink, "\"body\":\"parent\"") != 1)
+  {
+    std::cerr << "parent: expected its record once" << std::endl;
+    ++failures;
+  }
+  if (test::countOccurrences(*sink, "\"body\":\"child\"") != 0)
+  {
+    std::cerr << "parent: received the child's record" << std::endl;
+    ++failures;
+  }
+  exporter.shutdown();
+  return failures == 0 ? 0 : 1;
+}
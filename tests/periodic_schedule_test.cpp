@@ -0,0 +1,111 @@
+// Checks that metrics created, and spans first ended, after the pipeline has
+// gone idle are still sent every interval. The batcher used to sleep without
+// a deadline once its queue was empty, and only noticed the new schedule at
+// shutdown.
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <iostream>
+
+#include "exporter.h"
+#include "logger.h"
+#include "sink.h"
+#include "test_support.h"
+
+namespace
+{
+  const std::chrono::milliseconds kInterval(100);
+
+  ExporterOptions options(const std::shared_ptr<MemorySink> &sink)
+  {
+    ExporterOptions options;
+    options.token = "test";
+    options.sink = sink;
+    options.batchInterval = kInterval;
+    options.metricsInterval = kInterval;
+    options.traceInterval = kInterval;
+    options.clock = &test::manualNow;
+    return options;
+  }
+
+  LogMessage record(const std::string &body)
+  {
+    LogMessage message;
+    message.timestamp = std::chrono::system_clock::now();
+    message.body = body;
+    message.level = LogLevel::Info;
+    return message;
+  }
+
+  int metricsAfterIdle()
+  {
+    auto sink = std::make_shared<MemorySink>();
+    Exporter exporter(options(sink));
+
+    // Logs first, so the batcher is running and has nothing left to do.
+    exporter.enqueue(record("first"));
+    if (exporter.flush(std::chrono::seconds(5)) != 0)
+    {
+      std::cerr << "metrics: record not delivered" << std::endl;
+      return 1;
+    }
+    // Let the batcher go back to waiting.
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    Counter requests = exporter.counter("requests");
+    requests.add(3);
+    // The clock keeps moving while we wait, wherever the batcher takes the
+    // start of the schedule from.
+    bool sent = test::waitFor([&]()
+                              {
+                                test::advance(kInterval);
+                                return test::countPayloads(*sink, "metrics") > 0; });
+    exporter.shutdown();
+    if (!sent)
+    {
+      std::cerr << "metrics: nothing sent within the interval after going idle" << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  int tracesAfterIdle()
+  {
+    auto sink = std::make_shared<MemorySink>();
+    auto exporter = std::make_shared<Exporter>(options(sink));
+    Logger logger("test", exporter);
+
+    logger.info("first");
+    if (logger.flush(std::chrono::seconds(5)) != 0)
+    {
+      std::cerr << "traces: record not delivered" << std::endl;
+      return 1;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    {
+      Span span = logger.startSpan("work");
+    }
+    bool sent = test::waitFor([&]()
+                              {
+                                test::advance(kInterval);
+                                return test::countPayloads(*sink, "traces") > 0; });
+    exporter->shutdown();
+    if (!sent)
+    {
+      std::cerr << "traces: nothing sent within the interval after going idle" << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+}
+
+int main()
+{
+  int failures = 0;
+  failures += metricsAfterIdle();
+  failures += tracesAfterIdle();
+  return failures == 0 ? 0 : 1;
+}
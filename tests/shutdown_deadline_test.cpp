@@ -0,0 +1,116 @@
+// Checks that flush() and shutdown() honour their timeouts when the sink
+// never returns from send(), even after cancel(), and report the records
+// that were not delivered. A stuck sink used to hold shutdown, and with it
+// the destructor, until send() returned.
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+
+#include "exporter.h"
+#include "sink.h"
+#include "test_support.h"
+
+namespace
+{
+  const int kRecords = 3;
+  const std::chrono::milliseconds kTimeout(200);
+  // Room for the cancel grace period and a slow machine.
+  const std::chrono::milliseconds kBound(3000);
+
+  // Blocks in send() until released, ignoring cancel().
+  class StuckSink : public Sink
+  {
+  public:
+    bool send(const std::string &) override
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      ++entered_;
+      changed_.notify_all();
+      changed_.wait(lock, [&]()
+                    { return released_; });
+      --entered_;
+      changed_.notify_all();
+      return true;
+    }
+
+    void release()
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      released_ = true;
+      changed_.notify_all();
+    }
+
+    // Waits until no thread is inside send().
+    void waitIdle()
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [&]()
+                    { return entered_ == 0; });
+    }
+
+  private:
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    int entered_ = 0;
+    bool released_ = false;
+  };
+
+  LogMessage record(const std::string &body)
+  {
+    LogMessage message;
+    message.timestamp = std::chrono::system_clock::now();
+    message.body = body;
+    message.level = LogLevel::Info;
+    return message;
+  }
+
+  std::chrono::milliseconds since(std::chrono::steady_clock::time_point start)
+  {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  }
+}
+
+int main()
+{
+  auto sink = std::make_shared<StuckSink>();
+  int failures = 0;
+  {
+    ExporterOptions options;
+    options.token = "test";
+    options.sink = sink;
+    options.clock = &test::manualNow;
+    Exporter exporter(options);
+    for (int i = 0; i < kRecords; ++i)
+    {
+      exporter.enqueue(record("r" + std::to_string(i)));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    size_t undelivered = exporter.flush(kTimeout);
+    if (since(start) > kBound || undelivered != kRecords)
+    {
+      std::cerr << "flush took " << since(start).count() << "ms and reported "
+                << undelivered << " undelivered" << std::endl;
+      ++failures;
+    }
+
+    start = std::chrono::steady_clock::now();
+    undelivered = exporter.shutdown(kTimeout);
+    if (since(start) > kBound || undelivered != kRecords)
+    {
+      std::cerr << "shutdown took " << since(start).count() << "ms and reported "
+                << undelivered << " undelivered" << std::endl;
+      ++failures;
+    }
+  }
+
+  // The abandoned sender is still inside send(); let it return before the
+  // sink goes away.
+  sink->release();
+  sink->waitIdle();
+  return failures == 0 ? 0 : 1;
+}
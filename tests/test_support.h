@@ -0,0 +1,80 @@
+#ifndef TEST_SUPPORT_H
+#define TEST_SUPPORT_H
+
+// Helpers shared by the tests: a manually advanced clock for
+// ExporterOptions::clock, and polling for what the pipeline delivers.
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <functional>
+
+#include "sink.h"
+
+namespace test
+{
+  inline std::atomic<int64_t> &manualNanos()
+  {
+    static std::atomic<int64_t> nanos(0);
+    return nanos;
+  }
+
+  inline std::chrono::steady_clock::time_point manualNow()
+  {
+    return std::chrono::steady_clock::time_point(std::chrono::nanoseconds(manualNanos().load()));
+  }
+
+  inline void advance(std::chrono::milliseconds by)
+  {
+    manualNanos() += std::chrono::duration_cast<std::chrono::nanoseconds>(by).count();
+  }
+
+  // Waits, in real time, for the batcher and sender to catch up. Returns
+  // whether done() became true within the timeout.
+  inline bool waitFor(const std::function<bool()> &done,
+                      std::chrono::milliseconds timeout = std::chrono::seconds(5))
+  {
+    auto giveUp = std::chrono::steady_clock::now() + timeout;
+    while (std::chrono::steady_clock::now() < giveUp)
+    {
+      if (done())
+      {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return done();
+  }
+
+  // Number of payloads of the given "type" the sink has received.
+  inline size_t countPayloads(const MemorySink &sink, const std::string &type)
+  {
+    std::string marker = "\"type\":\"" + type + "\"";
+    size_t count = 0;
+    for (auto &payload : sink.payloads())
+    {
+      if (payload.find(marker) != std::string::npos)
+      {
+        ++count;
+      }
+    }
+    return count;
+  }
+
+  // Number of times needle occurs across the sink's payloads.
+  inline size_t countOccurrences(const MemorySink &sink, const std::string &needle)
+  {
+    size_t count = 0;
+    for (auto &payload : sink.payloads())
+    {
+      for (size_t at = payload.find(needle); at != std::string::npos; at = payload.find(needle, at + needle.size()))
+      {
+        ++count;
+      }
+    }
+    return count;
+  }
+}
+
+#endif // TEST_SUPPORT_H